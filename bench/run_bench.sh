@@ -0,0 +1,143 @@
+#!/bin/sh
+#
+# run_bench.sh
+#
+# Measure the overhead of the hooks of pg_simula and the accuracy of the
+# injected WAIT. A temporary cluster is created and restarted for each
+# configuration, so pg_simula must be installed to the PostgreSQL that
+# PGBIN points to.
+#
+# Cases:
+#   absent    pg_simula is not in shared_preload_libraries
+#   disabled  loaded, pg_simula.enabled is off
+#   events=N  enabled with N events that match no statement
+#   wait=D    enabled with a WAIT of D microseconds for every SELECT
+#
+# Environment variables:
+#   PGBIN           directory of initdb, pg_ctl, psql and pgbench
+#   BENCH_PORT      port of the temporary cluster (default 55432)
+#   BENCH_SCALE     pgbench scale factor (default 10)
+#   BENCH_CLIENTS   number of clients (default 4)
+#   BENCH_TIME      seconds to run each case (default 10)
+#   BENCH_EVENTS    numbers of events for the overhead cases (default "0 10 1000")
+#   BENCH_DELAYS    wait times in microseconds for the accuracy cases
+#                   (default "100 1000 10000")
+
+set -e
+
+PGBIN=${PGBIN:-$(pg_config --bindir)}
+BENCH_PORT=${BENCH_PORT:-55432}
+BENCH_SCALE=${BENCH_SCALE:-10}
+BENCH_CLIENTS=${BENCH_CLIENTS:-4}
+BENCH_TIME=${BENCH_TIME:-10}
+BENCH_EVENTS=${BENCH_EVENTS:-"0 10 1000"}
+BENCH_DELAYS=${BENCH_DELAYS:-"100 1000 10000"}
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+DATADIR=$(mktemp -d "${TMPDIR:-/tmp}/pg_simula_bench.XXXXXX")
+LOGFILE="$DATADIR/server.log"
+DB=postgres
+
+export PGPORT=$BENCH_PORT
+export PGHOST=$DATADIR
+
+cleanup()
+{
+	"$PGBIN/pg_ctl" -D "$DATADIR/data" -m immediate stop >/dev/null 2>&1 || true
+	rm -rf "$DATADIR"
+}
+trap cleanup EXIT
+
+# Restart the server with the given shared_preload_libraries
+start_server()
+{
+	"$PGBIN/pg_ctl" -D "$DATADIR/data" -m fast stop >/dev/null 2>&1 || true
+	"$PGBIN/pg_ctl" -D "$DATADIR/data" -l "$LOGFILE" -w \
+		-o "-p $BENCH_PORT -k $DATADIR -c listen_addresses='' -c shared_preload_libraries='$1'" \
+		start >/dev/null
+}
+
+psql_c()
+{
+	"$PGBIN/psql" -X -q -v ON_ERROR_STOP=1 -d "$DB" -c "$1" >/dev/null
+}
+
+# Replace the events with n events whose operations never match
+setup_events()
+{
+	psql_c "SELECT clear_all_events();"
+	if [ "$1" -gt 0 ]; then
+		# The management function publishes the whole table at commit
+		psql_c "BEGIN;
+			INSERT INTO simula_events (operation, action, sec)
+				SELECT 'NO OPERATION ' || g, 'WAIT', 0
+				FROM generate_series(2, $1) g;
+			SELECT add_simula_event('NO OPERATION 1', 'WAIT', 0);
+			COMMIT;"
+	fi
+}
+
+# Run pgbench and print "tps latency_ms" of the given script
+run_pgbench()
+{
+	"$PGBIN/pgbench" -n -M prepared -c "$BENCH_CLIENTS" -j "$BENCH_CLIENTS" \
+		-T "$BENCH_TIME" -D scale="$BENCH_SCALE" -f "$BENCH_DIR/$1" "$DB" 2>/dev/null |
+		awk '/^tps/ { tps = $3 } /^latency average/ { lat = $4 }
+			 END { printf "%s %s\n", tps, lat }'
+}
+
+report()
+{
+	printf "%-12s %-12s %12s %12s\n" "$1" "$2" "$3" "$4"
+}
+
+"$PGBIN/initdb" -D "$DATADIR/data" -N >/dev/null
+
+start_server ""
+"$PGBIN/pgbench" -i -q -s "$BENCH_SCALE" "$DB" >/dev/null 2>&1
+
+echo "Hook overhead ($BENCH_CLIENTS clients, $BENCH_TIME s each)"
+report "case" "script" "tps" "latency(ms)"
+
+for script in select.sql update.sql; do
+	set -- $(run_pgbench $script)
+	report "absent" "$script" "$1" "$2"
+done
+
+start_server "pg_simula"
+psql_c "CREATE EXTENSION IF NOT EXISTS pg_simula;"
+
+for script in select.sql update.sql; do
+	set -- $(PGOPTIONS="-c pg_simula.enabled=off" run_pgbench $script)
+	report "disabled" "$script" "$1" "$2"
+done
+
+for n in $BENCH_EVENTS; do
+	setup_events "$n"
+	for script in select.sql update.sql; do
+		set -- $(PGOPTIONS="-c pg_simula.enabled=on" run_pgbench $script)
+		report "events=$n" "$script" "$1" "$2"
+	done
+done
+
+# The baseline of the accuracy is enabled with no event
+setup_events 0
+set -- $(PGOPTIONS="-c pg_simula.enabled=on" run_pgbench select.sql)
+base=$2
+
+echo
+echo "WAIT accuracy (latency compared with events=0: $base ms)"
+printf "%-12s %12s %12s %12s %12s\n" "case" "requested" "observed" "slept" "error(%)"
+
+for delay in $BENCH_DELAYS; do
+	psql_c "SELECT add_simula_event('SELECT', 'WAIT', 0, usec => $delay);
+		SELECT pg_simula_stats_reset();"
+	set -- $(PGOPTIONS="-c pg_simula.enabled=on" run_pgbench select.sql)
+	observed=$(echo "$2 $base" | awk '{ printf "%.1f", ($1 - $2) * 1000 }')
+	slept=$("$PGBIN/psql" -X -A -t -d "$DB" -c \
+		"SELECT round(total_delay::numeric / nullif(fires, 0), 1)
+		   FROM pg_simula_stats WHERE operation = 'SELECT'")
+	error=$(echo "$observed $delay" | awk '{ printf "%.1f", ($1 - $2) * 100 / $2 }')
+	printf "%-12s %12s %12s %12s %12s\n" "wait=$delay" "$delay" "$observed" "$slept" "$error"
+	psql_c "SELECT clear_all_events();"
+done
@@ -0,0 +1,3 @@
+-- Point selection on pgbench_accounts, the hot path of the benchmark
+\set aid random(1, 100000 * :scale)
+SELECT abalance FROM pgbench_accounts WHERE aid = :aid;
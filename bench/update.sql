@@ -0,0 +1,4 @@
+-- Single-row update, which also exercises the hooks at commit
+\set aid random(1, 100000 * :scale)
+\set delta random(-5000, 5000)
+UPDATE pgbench_accounts SET abalance = abalance + :delta WHERE aid = :aid;
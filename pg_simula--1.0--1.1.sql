@@ -0,0 +1,99 @@
+/* pg_simula--1.0--1.1.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pg_simula UPDATE TO '1.1'" to load this file. \quit
+
+ALTER TABLE simula_events
+	ADD COLUMN usec bigint NOT NULL DEFAULT 0,
+	ADD COLUMN distribution text NOT NULL DEFAULT 'fixed',
+	ADD COLUMN jitter bigint NOT NULL DEFAULT 0,
+	ADD COLUMN shape float8 NOT NULL DEFAULT 0,
+	ADD COLUMN probability float8 NOT NULL DEFAULT 1.0
+		CHECK (probability >= 0 AND probability <= 1),
+	ADD COLUMN relation regclass NOT NULL DEFAULT 0,
+	ADD COLUMN first_block bigint NOT NULL DEFAULT 0,
+	ADD COLUMN last_block bigint NOT NULL DEFAULT -1,
+	ADD COLUMN rate float8 NOT NULL DEFAULT 0,
+	ADD COLUMN start_at timestamptz NOT NULL DEFAULT '-infinity',
+	ADD COLUMN stop_at timestamptz NOT NULL DEFAULT 'infinity',
+	ADD COLUMN period interval NOT NULL DEFAULT '0',
+	ADD COLUMN active interval NOT NULL DEFAULT '0',
+	ADD COLUMN queryid bigint NOT NULL DEFAULT 0,
+	ADD COLUMN skip bigint NOT NULL DEFAULT 0,
+	ADD COLUMN times bigint NOT NULL DEFAULT 0,
+	ADD COLUMN role regrole NOT NULL DEFAULT 0,
+	ADD COLUMN database oid NOT NULL DEFAULT 0,
+	ADD COLUMN application_name text NOT NULL DEFAULT '',
+	ADD COLUMN size_mb int NOT NULL DEFAULT 0,
+	ADD COLUMN lock_target text NOT NULL DEFAULT '',
+	ADD COLUMN lock_mode text NOT NULL DEFAULT 'ExclusiveLock';
+
+-- An operation can have an event for each target relation and query
+ALTER TABLE simula_events
+	DROP CONSTRAINT simula_events_pkey,
+	ADD CONSTRAINT simula_events_pkey PRIMARY KEY (operation, relation, queryid);
+
+DROP FUNCTION add_simula_event(text, text, int);
+CREATE FUNCTION add_simula_event(operation text, action text, sec int,
+				 usec bigint DEFAULT 0,
+				 distribution text DEFAULT 'fixed',
+				 jitter bigint DEFAULT 0,
+				 shape float8 DEFAULT 0,
+				 probability float8 DEFAULT 1.0,
+				 relation regclass DEFAULT 0,
+				 first_block bigint DEFAULT 0,
+				 last_block bigint DEFAULT -1,
+				 rate float8 DEFAULT 0,
+				 start_at timestamptz DEFAULT '-infinity',
+				 stop_at timestamptz DEFAULT 'infinity',
+				 period interval DEFAULT '0',
+				 active interval DEFAULT '0',
+				 queryid bigint DEFAULT 0,
+				 skip bigint DEFAULT 0,
+				 times bigint DEFAULT 0,
+				 role regrole DEFAULT 0,
+				 database oid DEFAULT 0,
+				 application_name text DEFAULT '',
+				 size_mb int DEFAULT 0,
+				 lock_target text DEFAULT '',
+				 lock_mode text DEFAULT 'ExclusiveLock')
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+-- Add many events in one statement
+CREATE FUNCTION add_simula_events(operation text[], action text[], sec int[])
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION add_simula_events(events simula_events[])
+RETURNS bool
+AS 'MODULE_PATHNAME', 'add_simula_event_rows'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION pg_simula_stats(
+	OUT dbid oid,
+	OUT operation text,
+	OUT relid oid,
+	OUT queryid bigint,
+	OUT action text,
+	OUT matches bigint,
+	OUT fires bigint,
+	OUT errors bigint,
+	OUT total_delay bigint,
+	OUT max_delay bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW pg_simula_stats AS
+	SELECT * FROM pg_simula_stats();
+
+CREATE FUNCTION pg_simula_stats_reset()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+REVOKE ALL ON FUNCTION pg_simula_stats_reset() FROM PUBLIC;
@@ -9,9 +9,23 @@
 
 #include "postgres.h"
 
+#include <ctype.h>
+#include <math.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "access/parallel.h"
+#include "access/relscan.h"
 #include "access/transam.h"
 #include "access/xact.h"
+#include "access/xlog.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_namespace.h"
+#include "catalog/pg_type.h"
+#include "executor/executor.h"
 #include "executor/spi.h"
+#include "commands/dbcommands.h"
 #include "commands/extension.h"
 #include "fmgr.h"
 #include "funcapi.h"
@@ -19,41 +33,476 @@
 #include "libpq/libpq-be.h"
 #include "libpq/auth.h"
 #include "miscadmin.h"
-#include "optimizer/planner.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
 #include "optimizer/prep.h"
+#include "parser/parsetree.h"
 #include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "port/atomics.h"
+#include "portability/instr_time.h"
 #include "replication/syncrep.h"
+#include "replication/walreceiver.h"
+#include "replication/walsender.h"
+#include "storage/bufmgr.h"
+#include "storage/fd.h"
 #include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lmgr.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
 #include "storage/spin.h"
 #include "tcop/utility.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/jsonapi.h"
+#include "utils/lsyscache.h"
 #include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+#include "utils/typcache.h"
+#include "utils/varlena.h"
 #include "utils/ps_status.h"
 #include "utils/memutils.h"
 
 #define EVENT_TABLE_NAME	"simula_events"
-#define MAX_LENGTH	100
+
+/* Pseudo operation done for each heap page read by a scan */
+#define SIMULA_OP_PAGE_READ	"PAGE READ"
+
+/* Pseudo operations done at commit of a transaction writing WAL */
+#define SIMULA_OP_WAL_FLUSH	"WAL FLUSH"
+#define SIMULA_OP_SYNCREP_WAIT	"SYNCREP WAIT"
+
+/* Pseudo operation of WAL replay on a standby, done by the scenario worker */
+#define SIMULA_OP_REPLAY	"REPLAY"
+
+/* Pseudo operation done by each parallel worker at start of its execution */
+#define SIMULA_OP_PARALLEL_WORKER	"PARALLEL WORKER"
+
+/* Number of LWLocks that HOLD_LOCK action can hold, as "lwlock:N" */
+#define SIMULA_NUM_HOLD_LWLOCKS	16
+
+/*
+ * Wait events reported while pg_simula sleeps, so that the injected waits
+ * are told apart from the real ones. PostgreSQL 10 cannot name the events
+ * of extensions, so all of them are shown as "Extension" in
+ * pg_stat_activity; the event IDs differ for tools reading wait_event_info.
+ */
+typedef enum SimulaWaitEvent
+{
+	SIMULA_WAIT_STATEMENT = PG_WAIT_EXTENSION,	/* WAIT of a statement */
+	SIMULA_WAIT_PAGE_READ,		/* WAIT of PAGE READ */
+	SIMULA_WAIT_WAL_FLUSH,		/* WAIT of WAL FLUSH */
+	SIMULA_WAIT_SYNCREP,		/* WAIT of SYNCREP WAIT */
+	SIMULA_WAIT_THROTTLE,		/* THROTTLE and THROTTLE_ROWS */
+	SIMULA_WAIT_AUTH_DELAY,		/* pg_simula.auth_delay */
+	SIMULA_WAIT_SCENARIO,		/* scenario worker between steps */
+	SIMULA_WAIT_HOLD_LOCK,		/* HOLD_LOCK holding the lock */
+	SIMULA_WAIT_PARALLEL_WORKER	/* WAIT of PARALLEL WORKER */
+} SimulaWaitEvent;
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
 
 PG_MODULE_MAGIC;
 
 PG_FUNCTION_INFO_V1(clear_all_events);
+PG_FUNCTION_INFO_V1(pg_simula_stats);
+PG_FUNCTION_INFO_V1(pg_simula_stats_reset);
 
 void	_PG_init(void);
 void	_PG_fini(void);
 
+PGDLLEXPORT void pg_simula_worker_main(Datum main_arg);
+
+/* Simulation actions. Must be the same order as ActionTable */
+typedef enum SimulaAction
+{
+	SIMULA_ACTION_ERROR = 0,
+	SIMULA_ACTION_PANIC,
+	SIMULA_ACTION_WAIT,
+	SIMULA_ACTION_FATAL,
+	SIMULA_ACTION_THROTTLE,
+	SIMULA_ACTION_THROTTLE_ROWS,
+	SIMULA_ACTION_BURN,
+	SIMULA_ACTION_MEMORY,
+	SIMULA_ACTION_HOLD_LOCK
+} SimulaAction;
+
+/* Kinds of the lock held by HOLD_LOCK action */
+typedef enum SimulaLockType
+{
+	SIMULA_LOCK_NONE = 0,
+	SIMULA_LOCK_RELATION,		/* heavyweight lock on a relation */
+	SIMULA_LOCK_ADVISORY,		/* advisory lock of a bigint key */
+	SIMULA_LOCK_LWLOCK			/* LWLock of pg_simula tranche */
+} SimulaLockType;
+
+/* Distributions of wait time. Must be the same order as DistributionNames */
+typedef enum SimulaDistribution
+{
+	SIMULA_DIST_FIXED = 0,
+	SIMULA_DIST_UNIFORM,
+	SIMULA_DIST_NORMAL,
+	SIMULA_DIST_EXPONENTIAL,
+	SIMULA_DIST_PARETO
+} SimulaDistribution;
+
+static const char *const DistributionNames[] =
+{
+	"fixed",
+	"uniform",
+	"normal",
+	"exponential",
+	"pareto",
+	NULL
+};
+
+/* Where an event comes from */
+typedef enum SimulaSource
+{
+	SIMULA_SOURCE_TABLE = 0,	/* simula_events table */
+	SIMULA_SOURCE_SCRIPT,		/* scenario script run by the worker */
+	SIMULA_SOURCE_FILE			/* pg_simula.scenario_file */
+} SimulaSource;
+
 typedef struct SimualEvent
 {
-	char operation[MAX_LENGTH];
-	char action[MAX_LENGTH];
-	int	sec;
+	SimulaSource source;
+	Oid	dbid;			/* database whose simula_events has this event, or
+						 * InvalidOid for all databases */
+	char operation[NAMEDATALEN];	/* upper-cased command tag */
+	Oid	relid;			/* target relation, or InvalidOid for all */
+	SimulaAction action;
+	int64	usec;		/* (mean) wait time in microseconds */
+	SimulaDistribution distribution;
+	int64	jitter;		/* stddev or half width of wait time */
+	double	shape;		/* shape parameter of pareto distribution */
+	double	probability;	/* probability of doing the action */
+	int64	first_block;	/* block range of PAGE READ event; a negative */
+	int64	last_block;		/* last_block means the end of relation */
+	double	rate;		/* operations or rows per second of THROTTLE */
+	TimestampTz	start_at;	/* the event is done only from start_at */
+	TimestampTz	stop_at;	/* until stop_at */
+	int64	period;		/* if positive, done only for the first active */
+	int64	active;		/* microseconds of every period microseconds */
+	int64	queryid;	/* target query identifier, or 0 for all */
+	int64	skip;		/* # of first occurrences not to do the action */
+	int64	times;		/* if positive, done only for the next times */
+	Oid		roleid;		/* done only for the role if valid */
+	Oid		datid;		/* done only in the database if valid */
+	char	appname[NAMEDATALEN];	/* done only for the application_name
+									 * if not empty */
+	int32	size_mb;	/* megabytes allocated by MEMORY */
+	SimulaLockType lock_type;	/* lock held by HOLD_LOCK */
+	int64	lock_key;	/* relation OID, advisory key or LWLock number */
+	LOCKMODE lock_mode;
 } SimulaEvent;
-List *SimulaEvents = NIL;
+
+/*
+ * Columns of simula_events. The arguments of add_simula_event() are the
+ * same order as this, and numbered by EventColumnNumber.
+ */
+typedef struct EventColumn
+{
+	const char *name;
+	Oid		type;
+	bool	key;		/* part of the primary key? */
+} EventColumn;
+
+static const EventColumn EventColumns[] =
+{
+	{"operation", TEXTOID, true},
+	{"action", TEXTOID, false},
+	{"sec", INT4OID, false},
+	{"usec", INT8OID, false},
+	{"distribution", TEXTOID, false},
+	{"jitter", INT8OID, false},
+	{"shape", FLOAT8OID, false},
+	{"probability", FLOAT8OID, false},
+	{"relation", REGCLASSOID, true},
+	{"first_block", INT8OID, false},
+	{"last_block", INT8OID, false},
+	{"rate", FLOAT8OID, false},
+	{"start_at", TIMESTAMPTZOID, false},
+	{"stop_at", TIMESTAMPTZOID, false},
+	{"period", INTERVALOID, false},
+	{"active", INTERVALOID, false},
+	{"queryid", INT8OID, true},
+	{"skip", INT8OID, false},
+	{"times", INT8OID, false},
+	{"role", REGROLEOID, false},
+	{"database", OIDOID, false},
+	{"application_name", TEXTOID, false},
+	{"size_mb", INT4OID, false},
+	{"lock_target", TEXTOID, false},
+	{"lock_mode", TEXTOID, false}
+};
+
+#define NUM_EVENT_COLUMNS	lengthof(EventColumns)
+
+/* Index of each column in EventColumns */
+typedef enum EventColumnNumber
+{
+	EVENT_COL_OPERATION = 0,
+	EVENT_COL_ACTION,
+	EVENT_COL_SEC,
+	EVENT_COL_USEC,
+	EVENT_COL_DISTRIBUTION,
+	EVENT_COL_JITTER,
+	EVENT_COL_SHAPE,
+	EVENT_COL_PROBABILITY,
+	EVENT_COL_RELATION,
+	EVENT_COL_FIRST_BLOCK,
+	EVENT_COL_LAST_BLOCK,
+	EVENT_COL_RATE,
+	EVENT_COL_START_AT,
+	EVENT_COL_STOP_AT,
+	EVENT_COL_PERIOD,
+	EVENT_COL_ACTIVE,
+	EVENT_COL_QUERYID,
+	EVENT_COL_SKIP,
+	EVENT_COL_TIMES,
+	EVENT_COL_ROLE,
+	EVENT_COL_DATABASE,
+	EVENT_COL_APPLICATION_NAME,
+	EVENT_COL_SIZE_MB,
+	EVENT_COL_LOCK_TARGET,
+	EVENT_COL_LOCK_MODE
+} EventColumnNumber;
+
+/*
+ * Statistics of an event. These are updated without any lock.
+ */
+typedef struct SimulaEventStats
+{
+	pg_atomic_uint64 matches;		/* # of executions of the operation */
+	pg_atomic_uint64 fires;			/* # of times the action was done */
+	pg_atomic_uint64 errors;		/* # of errors raised by the action */
+	pg_atomic_uint64 total_delay;	/* total wait time in microseconds */
+	pg_atomic_uint64 max_delay;		/* max wait time in microseconds */
+} SimulaEventStats;
+
+/*
+ * An entry of the shared catalog. An event keeps the same slot as long as
+ * the event exists, so its statistics survive republishing.
+ */
+typedef struct SimulaSlot
+{
+	bool	in_use;
+	SimulaEvent event;
+	SimulaEventStats stats;
+	pg_atomic_uint64 throttle_tat;	/* THROTTLE bucket; see throttleEvent() */
+	pg_atomic_uint64 occurrences;	/* # of occurrences counted for skip and
+									 * times in all backends */
+} SimulaSlot;
+
+/*
+ * A database whose simula_events is loaded to the shared catalog, and when
+ * the table was read. A backend that has seen the table changed after that,
+ * e.g. by WAL replay on a standby, reads the table again.
+ */
+typedef struct SimulaDatabase
+{
+	Oid		dbid;
+	TimestampTz	loaded_at;
+} SimulaDatabase;
+
+/*
+ * Shared event catalog.
+ *
+ * The events of all databases where pg_simula is created are kept here so
+ * that the hook functions never need to read simula_events table. The table
+ * of a database is read only once when the database is not loaded yet, and
+ * then is published again at commit of a transaction that modified it.
+ * The array of the loaded databases follows the slots.
+ */
+typedef struct SimulaSharedState
+{
+	pg_atomic_uint64 generation;	/* bumped whenever the catalog changes */
+	pg_atomic_uint64 wal_requested;	/* # of WAL FLUSH requested */
+	pg_atomic_uint64 wal_flushed;	/* # of WAL FLUSH requests done */
+	LWLock	*wal_lock;		/* held while doing WAL FLUSH */
+	LWLockPadded *hold_locks;	/* LWLocks for HOLD_LOCK */
+	pg_atomic_uint64 conn_attempts;	/* # of authenticated connections */
+	pg_atomic_uint64 conn_tat;		/* bucket of max_connections_per_sec */
+	LWLock	*lock;			/* protects all fields below */
+	Latch	*worker_latch;	/* latch of the scenario worker, if running */
+	int		ndatabases;		/* # of loaded databases */
+	SimulaDatabase *databases;	/* pg_simula.max_databases entries */
+	int		nslots;			/* # of slots ever used */
+	SimulaSlot slots[FLEXIBLE_ARRAY_MEMBER];
+} SimulaSharedState;
+
+static SimulaSharedState *simula_state = NULL;
+
+/*
+ * Key of an event of a source and a database in the shared catalog, and an
+ * entry of the index of the events being published by indexEvents().
+ */
+typedef struct SimulaSlotKey
+{
+	char	operation[NAMEDATALEN];	/* zero-padded */
+	Oid		relid;
+	int64	queryid;
+	Oid		datid;
+} SimulaSlotKey;
+
+typedef struct SimulaIndexEntry
+{
+	SimulaSlotKey key;	/* hash key; must be first */
+	int		slot;		/* slot assigned to the event, or -1 */
+} SimulaIndexEntry;
+
+/*
+ * Backend-local copy of the events of the current database, and the
+ * generation of the shared catalog it was taken from. The events are
+ * indexed by upper-cased command tag, target relation and query identifier,
+ * and have their action function already resolved.
+ */
+typedef struct SimulaEventKey
+{
+	char	operation[NAMEDATALEN];	/* zero-padded */
+	Oid		relid;
+	int64	queryid;
+} SimulaEventKey;
+
+typedef struct SimulaEventEntry SimulaEventEntry;
+typedef void (*act_func) (SimulaEventEntry *entry);
+
+/*
+ * Statistics accumulated locally, and added to the shared catalog at end of
+ * transaction so that backends don't contend on the same cache line.
+ */
+typedef struct SimulaLocalStats
+{
+	uint64	matches;
+	uint64	fires;
+	uint64	errors;
+	uint64	total_delay;
+	uint64	max_delay;
+} SimulaLocalStats;
+
+struct SimulaEventEntry
+{
+	SimulaEventKey key;	/* hash key; must be first */
+	act_func func;
+	int		slot;		/* index of the shared catalog */
+	SimulaEvent event;
+	bool	dirty;		/* in DirtyEntries? */
+	SimulaLocalStats stats;
+
+	/*
+	 * Whether the event is in its time window, valid until toggle_at. Only
+	 * the events having scheduled set need to check the clock.
+	 */
+	bool	scheduled;
+	bool	in_window;
+	TimestampTz	toggle_at;
+
+	/* The next event of the same query identifier in SimulaQueryEvents */
+	SimulaEventEntry *next_query;
+
+	/* Whether the role and application_name of the session match */
+	bool	applies;
+};
+
+/*
+ * Events targeting a query identifier are also indexed by it alone, so that
+ * finding them for a statement is an integer probe. The entries point into
+ * SimulaEvents and are rebuilt with it.
+ */
+typedef struct SimulaQueryEntry
+{
+	int64	queryid;	/* hash key; must be first */
+	SimulaEventEntry *events;
+} SimulaQueryEntry;
+
+static HTAB *SimulaEvents = NULL;
+static HTAB *SimulaQueryEvents = NULL;
+static uint64 SimulaEventsGeneration = 0;
+static bool SimulaEventsValid = false;
+
+/*
+ * True if any of SimulaEvents targets a specific relation. Otherwise we
+ * don't need to find target relations of statements at all.
+ */
+static bool SimulaEventsHaveRelations = false;
+
+/* True if any of SimulaEvents is PAGE READ event */
+static bool SimulaEventsHavePageReads = false;
+
+/*
+ * True if any of SimulaEvents is only for a role or an application_name.
+ * Otherwise all the events apply to every session.
+ */
+static bool SimulaEventsHaveFilters = false;
+
+/* The role and application_name for which applies of SimulaEvents is */
+static Oid	FilterUserId = InvalidOid;
+static char FilterAppName[NAMEDATALEN] = "";
+
+/*
+ * Entries whose local statistics have not been flushed yet. We flush them
+ * when this gets full even in the middle of a transaction.
+ */
+#define MAX_DIRTY_ENTRIES	64
+static SimulaEventEntry *DirtyEntries[MAX_DIRTY_ENTRIES];
+static int	NumDirtyEntries = 0;
+
+/*
+ * A scan node whose ExecProcNode is wrapped to do the PAGE READ event, or
+ * the THROTTLE_ROWS event of a query if planstate is NULL. It has its own
+ * copy of the event entry since SimulaEvents can be rebuilt while the query
+ * is running.
+ */
+typedef struct SimulaScan
+{
+	PlanState  *planstate;
+	ExecProcNodeMtd	orig_ExecProcNode;
+	EState	   *estate;		/* executor state the node belongs to */
+	SubTransactionId subid;	/* subtransaction that started the query */
+	BlockNumber	lastblock;	/* heap block of the last returned tuple */
+	SimulaEventEntry entry;
+} SimulaScan;
+
+/* Events of running queries, allocated in TopMemoryContext */
+static List *SimulaScans = NIL;
+
+/*
+ * Wrapped scan nodes of SimulaScans, so that ExecProcNode finds its own
+ * without walking the list for every tuple.
+ */
+typedef struct SimulaScanNode
+{
+	PlanState  *planstate;		/* hash key */
+	SimulaScan *scan;
+} SimulaScanNode;
+
+static HTAB *SimulaScanNodes = NULL;
+
+/* The scan found last by pg_simula_ExecScan(), which is mostly the next one */
+static SimulaScan *SimulaLastScan = NULL;
+
+/* The heap page whose PAGE READ event is being done, for error messages */
+static Oid	SimulaPageRelid = InvalidOid;
+static BlockNumber SimulaPageBlock = InvalidBlockNumber;
 
 PG_FUNCTION_INFO_V1(add_simula_event);
+PG_FUNCTION_INFO_V1(add_simula_events);
+PG_FUNCTION_INFO_V1(add_simula_event_rows);
 
 /* pg_simula hook functions */
-static PlannedStmt *pg_simula_planner(Query *parse, int cursorOptions,
-										 ParamListInfo boundParams);
+static void pg_simula_ExecutorStart(QueryDesc *queryDesc, int eflags);
+static void pg_simula_ExecutorRun(QueryDesc *queryDesc,
+								  ScanDirection direction,
+								  uint64 count, bool execute_once);
+static void pg_simula_ExecutorEnd(QueryDesc *queryDesc);
 static void pg_simula_ProcessUtility(PlannedStmt *pstmt,
 									  const char *queryString,
 									  ProcessUtilityContext context,
@@ -62,46 +511,200 @@ static void pg_simula_ProcessUtility(PlannedStmt *pstmt,
 									  DestReceiver *dest,
 									  char *completionTag);
 static void pg_simula_ClientAuthentication(Port *port, int status);
+static bool refuseConnectionByPercent(void);
+static bool refuseConnectionByRate(void);
 
 static void pg_simula_xact_callback(XactEvent event, void *arg);
+static void pg_simula_subxact_callback(SubXactEvent event,
+									   SubTransactionId mySubid,
+									   SubTransactionId parentSubid,
+									   void *arg);
+static void pg_simula_relcache_callback(Datum arg, Oid relid);
+static void pg_simula_shmem_exit(int code, Datum arg);
+static void registerCallbacks(void);
+
+static void pg_simula_shmem_startup(void);
+static Size pg_simula_memsize(void);
 
+static SimulaEvent *fetchEventTableData(MemoryContext cxt, int *nevents);
+static const char *tupleToEvent(HeapTuple tuple, TupleDesc tupdesc,
+								SimulaEvent *event);
+static const char *checkEvent(const SimulaEvent *event);
+static void initEvent(SimulaEvent *event, SimulaSource source,
+					  const char *operation, const char *action);
+static void checkEventArgs(FunctionCallInfo fcinfo);
+static HTAB *indexEvents(SimulaEvent *events, int nevents, MemoryContext cxt);
+static void publishEventTableData(Oid dbid, SimulaEvent *events, int nevents,
+								  HTAB *index, TimestampTz read_at,
+								  uint64 if_generation);
+static void unloadDatabase(Oid dbid);
+static void publishScenarioEvents(SimulaSource source, SimulaEvent *events,
+								  int nevents);
+static bool replaceSharedEvents(SimulaSource source, Oid dbid,
+								SimulaEvent *events, int nevents, HTAB *index);
+static void catalogChanged(void);
+static SimulaEvent *loadScenarioFile(const char *path, int *nevents);
 static void reloadEventTableData(void);
-static void doEventIfAny(const char *commandTag);
+static void stageEventTableData(void);
+static void lockEventTable(void);
+static Oid	eventTableRelid(void);
+static bool utilityModifiesEventTable(Node *parsetree);
+static void noteEventTableChange(Oid relid);
+static int	upsertEvents(int ncols, bool reset, const char *source,
+						 int nargs, Oid *argtypes, Datum *values);
+static SimulaEventEntry *doEventIfAny(const char *commandTag, List *relids,
+										int64 queryid);
+static SimulaEventEntry *lookupCommitEvent(const char *operation);
+static void doWalFlushEvent(SimulaEventEntry *entry);
+static bool fireEvent(SimulaEventEntry *entry);
+static void updateEventWindow(SimulaEventEntry *entry, TimestampTz now);
+static SimulaEventEntry *lookupEvent(const char *commandTag, Oid relid);
+static void checkEventFilters(void);
+static bool eventApplies(const SimulaEvent *event);
+static List *plannedStmtTargetRelations(PlannedStmt *pstmt);
+static List *utilityTargetRelations(Node *parsetree);
 static bool isPgSimulaLoaded(void);
+static bool isPgSimulaExtensionStmt(Node *parsetree);
 static bool needReloadAndEvent(const char *commandTag);
 
 /* Simulation functions */
-static void error_func(int sec);
-static void panic_func(int sec);
-static void wait_func(int sec);
-static void fatal_func(int sec);
+static void error_func(SimulaEventEntry *entry);
+static void panic_func(SimulaEventEntry *entry);
+static void wait_func(SimulaEventEntry *entry);
+static void fatal_func(SimulaEventEntry *entry);
+static void throttle_func(SimulaEventEntry *entry);
+static void throttle_rows_func(SimulaEventEntry *entry);
+static void burn_func(SimulaEventEntry *entry);
+static void memory_func(SimulaEventEntry *entry);
+static void hold_lock_func(SimulaEventEntry *entry);
+
+static int64 simula_sleep(int64 usec, uint32 wait_event_info,
+						  const char *activity);
+static SimulaLocalStats *eventStats(SimulaEventEntry *entry);
+static void flushEventStats(void);
+static void atomic_max_u64(pg_atomic_uint64 *ptr, uint64 value);
+static void throttleEvent(SimulaEventEntry *entry, uint64 ntokens);
+static uint64 monotonic_nsec(void);
+static void burnLoops(uint64 nloops);
+static void calibrateBurnLoops(void);
+
+static int lookupDistribution(const char *distribution);
+static int64 intervalToUsec(Interval *span);
+static int64 sampleWaitTime(const SimulaEvent *event);
+static uint64 simula_random(void);
+static double simula_random_double(void);
 
-typedef void (*act_func) (int sec);
 typedef struct Action
 {
 	char *action;
 	act_func func;
 } Action;
 
+/* Indexed by SimulaAction */
 Action ActionTable[] =
 {
 	{"error", error_func},
 	{"panic", panic_func},
 	{"wait", wait_func},
 	{"fatal", fatal_func},
+	{"throttle", throttle_func},
+	{"throttle_rows", throttle_rows_func},
+	{"burn", burn_func},
+	{"memory", memory_func},
+	{"hold_lock", hold_lock_func},
 	{NULL, NULL}
 };
 
-static planner_hook_type prev_planner = NULL;
+static int lookupAction(const char *action);
+
+/* Names of heavyweight lock modes, indexed by LOCKMODE */
+static const char *const LockModeNames[] =
+{
+	"INVALID",
+	"AccessShareLock",
+	"RowShareLock",
+	"RowExclusiveLock",
+	"ShareUpdateExclusiveLock",
+	"ShareLock",
+	"ShareRowExclusiveLock",
+	"ExclusiveLock",
+	"AccessExclusiveLock"
+};
+
+static const char *parseLockTarget(SimulaEvent *event, const char *target,
+								   bool lookup_names);
+static const char *parseLockMode(SimulaEvent *event, const char *mode);
+
+static bool wrapScanNodes(PlanState *planstate, EState *estate);
+static void addRowThrottle(EState *estate, SimulaEventEntry *entry);
+static void releaseScans(EState *estate, SubTransactionId subid);
+static TupleTableSlot *pg_simula_ExecScan(PlanState *pstate);
+static BlockNumber currentScanBlock(PlanState *pstate);
+
+static ExecutorStart_hook_type prev_ExecutorStart = NULL;
+static ExecutorRun_hook_type prev_ExecutorRun = NULL;
+static ExecutorEnd_hook_type prev_ExecutorEnd = NULL;
 static ProcessUtility_hook_type prev_ProcessUtility = NULL;
 static ClientAuthentication_hook_type prev_ClientAuthentication = NULL;
+static shmem_startup_hook_type prev_shmem_startup = NULL;
 
 static bool in_simula_event_progress = false;
 static bool registered_to_callback = false;
 
+/*
+ * Set when the current transaction modified simula_events. If the
+ * transaction has locked the table by lockEventTable(), the table is read
+ * into pending_events at pre-commit and published at commit. Otherwise the
+ * database is just marked as not loaded at commit, since a concurrent
+ * transaction might modify the table as well.
+ */
+static bool catalog_dirty = false;
+static bool event_table_locked = false;
+static bool pending_valid = false;
+static bool pending_loaded = false;
+
+/* State of the per-backend pseudo random number generator */
+static uint64 simula_prng_state = 0;
+static SimulaEvent *pending_events = NULL;
+static int	pending_nevents = 0;
+static HTAB *pending_index = NULL;
+static TimestampTz pending_read_at = 0;
+
+/*
+ * OID of simula_events of the current database, or InvalidOid if not known,
+ * and when we got its relcache invalidation not caused by ourselves, or 0.
+ * See pg_simula_relcache_callback().
+ */
+static Oid	SimulaTableRelid = InvalidOid;
+static TimestampTz SimulaTableChangedAt = 0;
+
+/* Set once we have warned that the shared catalog has no room */
+static bool warned_no_room = false;
+
+/* Database being dropped by the current transaction, if any */
+static Oid	pending_drop_dbid = InvalidOid;
+
 /* GUC parameter */
 static bool simulation_enabled = false;
 static bool connection_refused = false;
+static int	max_events = 1000;
+static int	max_databases = 64;
+static double connection_refuse_percent = 0;
+static int	max_connections_per_sec = 0;
+static int	auth_delay = 0;
+static bool scenario_worker = false;
+static char *scenario_script = NULL;
+static char *scenario_file = NULL;
+static bool burn_pin = false;
+
+/* BURN action spins for burn_chunk_loops between reading the clock */
+#define BURN_CHUNK_USEC	20
+static uint64 burn_chunk_loops = 0;
+static volatile uint64 burn_sink = 0;
+
+/* Memory allocated by MEMORY action, released at end of transaction */
+#define SIMULA_PAGE_SIZE	4096
+static MemoryContext SimulaMemoryContext = NULL;
 
 void
 _PG_init(void)
@@ -128,8 +731,147 @@ _PG_init(void)
 							 NULL,
 							 NULL);
 
-	prev_planner = planner_hook;
-	planner_hook = pg_simula_planner;
+	DefineCustomRealVariable("pg_simula.connection_refuse_percent",
+							 "Percentage of new connections to refuse",
+							 NULL,
+							 &connection_refuse_percent,
+							 0,
+							 0,
+							 100,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_simula.max_connections_per_sec",
+							"Maximum number of new connections accepted per second",
+							"Zero means no limit.",
+							&max_connections_per_sec,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_simula.auth_delay",
+							"Time to delay authentication of new connections",
+							NULL,
+							&auth_delay,
+							0,
+							0,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_simula.scenario_worker",
+							 "Start the worker running the scenario script",
+							 NULL,
+							 &scenario_worker,
+							 false,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomStringVariable("pg_simula.scenario_script",
+							   "Scenario script run by the scenario worker",
+							   NULL,
+							   &scenario_script,
+							   "",
+							   PGC_SIGHUP,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomStringVariable("pg_simula.scenario_file",
+							   "JSON file of simulation events loaded at server start",
+							   NULL,
+							   &scenario_file,
+							   "",
+							   PGC_SIGHUP,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomBoolVariable("pg_simula.burn_pin",
+							 "Pin the backend to its current CPU while doing BURN action",
+							 "This is supported only on Linux.",
+							 &burn_pin,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_simula.max_events",
+							"Maximum number of simulation events kept in shared memory",
+							NULL,
+							&max_events,
+							1000,
+							1,
+							1000000,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_simula.max_databases",
+							"Maximum number of databases whose simulation events are kept in shared memory",
+							NULL,
+							&max_databases,
+							64,
+							1,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	/* The shared event catalog is available only if preloaded */
+	if (process_shared_preload_libraries_in_progress)
+	{
+		RequestAddinShmemSpace(pg_simula_memsize());
+		RequestNamedLWLockTranche("pg_simula", 2 + SIMULA_NUM_HOLD_LWLOCKS);
+
+		prev_shmem_startup = shmem_startup_hook;
+		shmem_startup_hook = pg_simula_shmem_startup;
+
+		if (scenario_worker)
+		{
+			BackgroundWorker worker;
+
+			memset(&worker, 0, sizeof(worker));
+			worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+			worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+			worker.bgw_restart_time = 10;
+			snprintf(worker.bgw_name, BGW_MAXLEN, "pg_simula scenario worker");
+			snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_simula");
+			snprintf(worker.bgw_function_name, BGW_MAXLEN, "pg_simula_worker_main");
+			worker.bgw_main_arg = (Datum) 0;
+			worker.bgw_notify_pid = 0;
+			RegisterBackgroundWorker(&worker);
+		}
+	}
+
+	prev_ExecutorStart = ExecutorStart_hook;
+	ExecutorStart_hook = pg_simula_ExecutorStart;
+	prev_ExecutorRun = ExecutorRun_hook;
+	ExecutorRun_hook = pg_simula_ExecutorRun;
+	prev_ExecutorEnd = ExecutorEnd_hook;
+	ExecutorEnd_hook = pg_simula_ExecutorEnd;
 	prev_ProcessUtility = ProcessUtility_hook;
 	ProcessUtility_hook = pg_simula_ProcessUtility;
 	prev_ClientAuthentication = ClientAuthentication_hook;
@@ -139,16 +881,114 @@ _PG_init(void)
 /* Uninstall hook functions */
 void _PG_fini(void)
 {
-	planner_hook = prev_planner;
+	ExecutorStart_hook = prev_ExecutorStart;
+	ExecutorRun_hook = prev_ExecutorRun;
+	ExecutorEnd_hook = prev_ExecutorEnd;
 	ProcessUtility_hook = prev_ProcessUtility;
+	ClientAuthentication_hook = prev_ClientAuthentication;
+	shmem_startup_hook = prev_shmem_startup;
+}
+
+static Size
+pg_simula_memsize(void)
+{
+	return add_size(add_size(offsetof(SimulaSharedState, slots),
+							 mul_size(max_events, sizeof(SimulaSlot))),
+					mul_size(max_databases, sizeof(SimulaDatabase)));
+}
+
+/* Allocate or attach to the shared event catalog */
+static void
+pg_simula_shmem_startup(void)
+{
+	bool	found;
+	int		i;
+
+	if (prev_shmem_startup)
+		prev_shmem_startup();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	simula_state = ShmemInitStruct("pg_simula",
+								   pg_simula_memsize(),
+								   &found);
+	if (!found)
+	{
+		LWLockPadded *locks = GetNamedLWLockTranche("pg_simula");
+
+		pg_atomic_init_u64(&simula_state->generation, 1);
+		pg_atomic_init_u64(&simula_state->wal_requested, 0);
+		pg_atomic_init_u64(&simula_state->wal_flushed, 0);
+		pg_atomic_init_u64(&simula_state->conn_attempts, 0);
+		pg_atomic_init_u64(&simula_state->conn_tat, 0);
+		simula_state->wal_lock = &(locks[1].lock);
+		simula_state->lock = &(locks[0].lock);
+		simula_state->hold_locks = &(locks[2]);
+		simula_state->worker_latch = NULL;
+		simula_state->ndatabases = 0;
+		simula_state->databases =
+			(SimulaDatabase *) &(simula_state->slots[max_events]);
+		simula_state->nslots = 0;
+
+		for (i = 0; i < max_events; i++)
+		{
+			SimulaEventStats *stats = &(simula_state->slots[i].stats);
+
+			simula_state->slots[i].in_use = false;
+			pg_atomic_init_u64(&stats->matches, 0);
+			pg_atomic_init_u64(&stats->fires, 0);
+			pg_atomic_init_u64(&stats->errors, 0);
+			pg_atomic_init_u64(&stats->total_delay, 0);
+			pg_atomic_init_u64(&stats->max_delay, 0);
+			pg_atomic_init_u64(&simula_state->slots[i].throttle_tat, 0);
+			pg_atomic_init_u64(&simula_state->slots[i].occurrences, 0);
+		}
+
+		/* Nobody else sees the catalog yet, so we don't need the lock */
+		if (scenario_file != NULL && scenario_file[0] != '\0')
+		{
+			MemoryContext cxt;
+			MemoryContext oldcxt;
+			SimulaEvent *events;
+			int		nevents;
+
+			cxt = AllocSetContextCreate(CurrentMemoryContext,
+										"pg_simula scenario file",
+										ALLOCSET_DEFAULT_SIZES);
+			oldcxt = MemoryContextSwitchTo(cxt);
+
+			events = loadScenarioFile(scenario_file, &nevents);
+			if (!replaceSharedEvents(SIMULA_SOURCE_FILE, InvalidOid,
+									 events, nevents,
+									 indexEvents(events, nevents, cxt)))
+				ereport(WARNING,
+						(errmsg("pg_simula could not load all simulation events"),
+						 errhint("Consider increasing pg_simula.max_events.")));
+
+			MemoryContextSwitchTo(oldcxt);
+			MemoryContextDelete(cxt);
+		}
+	}
+
+	LWLockRelease(AddinShmemInitLock);
 }
 
 static bool
 needReloadAndEvent(const char *commandTag)
 {
-	if (simulation_enabled &&
-		!in_simula_event_progress &&
-		IsTransactionState() &&
+	if (!simulation_enabled || simula_state == NULL || in_simula_event_progress)
+		return false;
+
+	/*
+	 * Quick exit if our copy of the catalog is up-to-date and has no event,
+	 * which is also the case where pg_simula is not created on the database.
+	 */
+	if (SimulaEventsValid &&
+		hash_get_num_entries(SimulaEvents) == 0 &&
+		SimulaEventsGeneration == pg_atomic_read_u64(&simula_state->generation))
+		return false;
+
+	if (IsTransactionState() &&
 		pg_strcasecmp(commandTag, "START TRANSACTION") != 0 &&
 		pg_strcasecmp(commandTag, "BEGIN") != 0)
 		return true;
@@ -156,23 +996,47 @@ needReloadAndEvent(const char *commandTag)
 	return false;
 }
 
-static void
-reloadEventTableData(void)
+/*
+ * Get the value of the given column of simula_events. A column that doesn't
+ * exist in the table, which is the case where the extension is not updated
+ * yet, is treated as null.
+ */
+static Datum
+getEventColumn(HeapTuple tuple, TupleDesc tupdesc, const char *colname,
+			   bool *isnull)
+{
+	int		fnumber = SPI_fnumber(tupdesc, colname);
+
+	if (fnumber == SPI_ERROR_NOATTRIBUTE)
+	{
+		*isnull = true;
+		return (Datum) 0;
+	}
+
+	return SPI_getbinval(tuple, tupdesc, fnumber, isnull);
+}
+
+/*
+ * Read all events from simula_events table of the current database into an
+ * array allocated in cxt. Invalid events are ignored with a warning.
+ *
+ * The table is read with the latest snapshot even in REPEATABLE READ, since
+ * the result replaces the events of the database in the shared catalog.
+ */
+static SimulaEvent *
+fetchEventTableData(MemoryContext cxt, int *nevents)
 {
 	StringInfoData buf;
+	SimulaEvent *events = NULL;
 	int	ret;
 	int	ntup;
 	int i;
 
-	list_free_deep(SimulaEvents);
-	SimulaEvents = NIL;
-
-	if (!isPgSimulaLoaded())
-		return;
+	*nevents = 0;
 
 	SetCurrentStatementStartTimestamp();
 	SPI_connect();
-	PushActiveSnapshot(GetTransactionSnapshot());
+	PushActiveSnapshot(GetLatestSnapshot());
 
 	initStringInfo(&buf);
 	appendStringInfo(&buf, "SELECT * FROM public.%s", EVENT_TABLE_NAME);
@@ -188,268 +1052,4165 @@ reloadEventTableData(void)
         TupleDesc tupdesc = SPI_tuptable->tupdesc;
         SPITupleTable *tuptable = SPI_tuptable;
 
+		events = MemoryContextAllocZero(cxt, sizeof(SimulaEvent) * Max(ntup, 1));
+
 		for (i = 0; i < ntup; i++)
 		{
-            HeapTuple tuple = tuptable->vals[i];
-			SimulaEvent *event;
-			MemoryContext old;
-			char *operation = SPI_getvalue(tuple, tupdesc, 1);
-			char *action = SPI_getvalue(tuple, tupdesc, 2);
-			char *sec = SPI_getvalue(tuple, tupdesc, 3);
+			HeapTuple tuple = tuptable->vals[i];
+			const char *problem;
+
+			problem = tupleToEvent(tuple, tupdesc, &(events[*nevents]));
+			if (problem != NULL)
+			{
+				char   *operation = SPI_getvalue(tuple, tupdesc, 1);
 
-			old = MemoryContextSwitchTo(TopMemoryContext);
-			event = palloc(sizeof(SimulaEvent));
-			strncpy(event->operation, operation, MAX_LENGTH);
-			strncpy(event->action, action, MAX_LENGTH);
-			event->sec = atoi(sec);
-			SimulaEvents = lappend(SimulaEvents, event);
-			MemoryContextSwitchTo(old);
+				ereport(WARNING,
+						(errmsg("ignored simulation event for \"%s\": %s",
+								operation ? operation : "", problem)));
+				continue;
+			}
+			(*nevents)++;
 		}
 	}
 
 	SPI_finish();
 	PopActiveSnapshot();
+
+	return events;
 }
 
-Datum
-add_simula_event(PG_FUNCTION_ARGS)
+/*
+ * Make the event of the current database from a row of simula_events, which
+ * is also the element of the array given to add_simula_events(). Return the
+ * description of the problem if the row is not a valid event, otherwise NULL.
+ */
+static const char *
+tupleToEvent(HeapTuple tuple, TupleDesc tupdesc, SimulaEvent *event)
 {
-	text	*operation = PG_GETARG_TEXT_P(0);
-	text	*action = PG_GETARG_TEXT_P(1);
-	int		sec = PG_GETARG_INT32(2);
-	char	*ope_str = text_to_cstring(operation);
-	char	*act_str = text_to_cstring(action);
-	Action	*act;
-	bool	found = false;
-	StringInfoData	buf;
-	int		ret;
+	char   *operation = SPI_getvalue(tuple, tupdesc, 1);
+	char   *action = SPI_getvalue(tuple, tupdesc, 2);
+	char   *sec = SPI_getvalue(tuple, tupdesc, 3);
+	Datum	value;
+	bool	isnull;
+	int		act;
+	int		dist = SIMULA_DIST_FIXED;
+	const char *problem;
+	int		j;
 
-	in_simula_event_progress = true;
+	if (operation == NULL || action == NULL)
+		return "operation and action must not be null";
+	if ((act = lookupAction(action)) < 0)
+		return psprintf("invalid action: \"%s\"", action);
 
-	for (act = ActionTable; act->action != NULL; act++)
-	{
-		if (pg_strcasecmp(act->action, act_str) == 0)
-		{
-			found = true;
-			break;
-		}
-	}
+	memset(event, 0, sizeof(SimulaEvent));
+	event->source = SIMULA_SOURCE_TABLE;
+	event->dbid = MyDatabaseId;
+	for (j = 0; j < NAMEDATALEN - 1 && operation[j] != '\0'; j++)
+		event->operation[j] = pg_toupper((unsigned char) operation[j]);
+	event->operation[j] = '\0';
+	event->action = (SimulaAction) act;
 
-	if (!found)
-		ereport(ERROR, (errmsg("invalid action: \"%s\"", act_str)));
+	value = getEventColumn(tuple, tupdesc, "relation", &isnull);
+	event->relid = isnull ? InvalidOid : DatumGetObjectId(value);
+	event->usec = sec ? (int64) atoi(sec) * USECS_PER_SEC : 0;
 
-	initStringInfo(&buf);
-	appendStringInfo(&buf,
-					 "INSERT INTO %s VALUES('%s', '%s', %d) ON CONFLICT "
-					 "ON CONSTRAINT simula_events_pkey "
-					 "DO UPDATE SET (action, sec) = (excluded.action, excluded.sec)",
-					 EVENT_TABLE_NAME,
-					 ope_str, act_str, sec);
+	value = getEventColumn(tuple, tupdesc, "usec", &isnull);
+	if (!isnull)
+		event->usec += DatumGetInt64(value);
 
-	SetCurrentStatementStartTimestamp();
-	SPI_connect();
-	PushActiveSnapshot(GetTransactionSnapshot());
-	ret = SPI_execute(buf.data, false, 0);
-	SPI_finish();
-	PopActiveSnapshot();
+	value = getEventColumn(tuple, tupdesc, "distribution", &isnull);
+	if (!isnull &&
+		(dist = lookupDistribution(TextDatumGetCString(value))) < 0)
+		return psprintf("invalid distribution: \"%s\"",
+						TextDatumGetCString(value));
+	event->distribution = (SimulaDistribution) dist;
 
-	in_simula_event_progress = false;
+	value = getEventColumn(tuple, tupdesc, "jitter", &isnull);
+	event->jitter = isnull ? 0 : DatumGetInt64(value);
 
-	PG_RETURN_BOOL(ret);
-}
+	value = getEventColumn(tuple, tupdesc, "shape", &isnull);
+	event->shape = isnull ? 0 : DatumGetFloat8(value);
 
-/* Clear all simulation events */
-Datum
-clear_all_events(PG_FUNCTION_ARGS)
-{
-	int ret;
-	StringInfoData buf;
+	value = getEventColumn(tuple, tupdesc, "probability", &isnull);
+	event->probability = isnull ? 1.0 : DatumGetFloat8(value);
 
-	in_simula_event_progress = true;
-	SetCurrentStatementStartTimestamp();
-	SPI_connect();
-	PushActiveSnapshot(GetTransactionSnapshot());
+	value = getEventColumn(tuple, tupdesc, "first_block", &isnull);
+	event->first_block = isnull ? 0 : DatumGetInt64(value);
 
-	initStringInfo(&buf);
-	appendStringInfo(&buf, "TRUNCATE %s", EVENT_TABLE_NAME);
+	value = getEventColumn(tuple, tupdesc, "last_block", &isnull);
+	event->last_block = isnull ? -1 : DatumGetInt64(value);
 
-	ret = SPI_execute(buf.data, false, 0);
+	value = getEventColumn(tuple, tupdesc, "rate", &isnull);
+	event->rate = isnull ? 0 : DatumGetFloat8(value);
 
-	SPI_finish();
-	PopActiveSnapshot();
+	value = getEventColumn(tuple, tupdesc, "start_at", &isnull);
+	event->start_at = isnull ? DT_NOBEGIN : DatumGetTimestampTz(value);
 
-	in_simula_event_progress = false;
+	value = getEventColumn(tuple, tupdesc, "stop_at", &isnull);
+	event->stop_at = isnull ? DT_NOEND : DatumGetTimestampTz(value);
 
-    PG_RETURN_BOOL(ret);
-}
+	value = getEventColumn(tuple, tupdesc, "period", &isnull);
+	event->period = isnull ? 0 : intervalToUsec(DatumGetIntervalP(value));
 
-/* Check if pg_simula is already loaded (created) on the database */
-static bool
-isPgSimulaLoaded(void)
-{
-	return OidIsValid(get_extension_oid("pg_simula", true));
+	value = getEventColumn(tuple, tupdesc, "active", &isnull);
+	event->active = isnull ? 0 : intervalToUsec(DatumGetIntervalP(value));
+
+	value = getEventColumn(tuple, tupdesc, "queryid", &isnull);
+	event->queryid = isnull ? 0 : DatumGetInt64(value);
+
+	value = getEventColumn(tuple, tupdesc, "skip", &isnull);
+	event->skip = isnull ? 0 : DatumGetInt64(value);
+
+	value = getEventColumn(tuple, tupdesc, "times", &isnull);
+	event->times = isnull ? 0 : DatumGetInt64(value);
+
+	value = getEventColumn(tuple, tupdesc, "role", &isnull);
+	event->roleid = isnull ? InvalidOid : DatumGetObjectId(value);
+
+	value = getEventColumn(tuple, tupdesc, "database", &isnull);
+	event->datid = isnull ? InvalidOid : DatumGetObjectId(value);
+
+	value = getEventColumn(tuple, tupdesc, "application_name", &isnull);
+	if (!isnull &&
+		strlen(TextDatumGetCString(value)) >= NAMEDATALEN)
+		return psprintf("application_name must be shorter than %d characters",
+						NAMEDATALEN);
+	if (!isnull)
+		strlcpy(event->appname, TextDatumGetCString(value),
+				NAMEDATALEN);
+
+	value = getEventColumn(tuple, tupdesc, "size_mb", &isnull);
+	event->size_mb = isnull ? 0 : DatumGetInt32(value);
+
+	event->lock_mode = ExclusiveLock;
+	value = getEventColumn(tuple, tupdesc, "lock_mode", &isnull);
+	if (!isnull &&
+		(problem = parseLockMode(event, TextDatumGetCString(value))) != NULL)
+		return problem;
+
+	value = getEventColumn(tuple, tupdesc, "lock_target", &isnull);
+	if (!isnull &&
+		(problem = parseLockTarget(event, TextDatumGetCString(value),
+								   true)) != NULL)
+		return problem;
+
+	return checkEvent(event);
+}
+
+/*
+ * Check the parameters of the event. Return the description of the problem
+ * if invalid, otherwise NULL.
+ */
+static const char *
+checkEvent(const SimulaEvent *event)
+{
+	if (event->usec < 0 || event->jitter < 0)
+		return "wait time must not be negative";
+	if (event->distribution == SIMULA_DIST_PARETO && !(event->shape > 1.0))
+		return "shape of pareto distribution must be greater than 1";
+	if (!(event->probability >= 0.0 && event->probability <= 1.0))
+		return "probability must be between 0 and 1";
+	if (event->first_block < 0 || event->first_block > MaxBlockNumber ||
+		event->last_block > MaxBlockNumber ||
+		(event->last_block >= 0 && event->last_block < event->first_block))
+		return "invalid block range";
+	if ((event->action == SIMULA_ACTION_THROTTLE ||
+		 event->action == SIMULA_ACTION_THROTTLE_ROWS) && !(event->rate > 0.0))
+		return "throttle action requires a positive rate";
+	if (event->action == SIMULA_ACTION_MEMORY && event->size_mb <= 0)
+		return "MEMORY action requires a positive size_mb";
+	if (event->size_mb < 0)
+		return "size_mb must not be negative";
+	if (event->action == SIMULA_ACTION_HOLD_LOCK &&
+		event->lock_type == SIMULA_LOCK_NONE)
+		return "HOLD_LOCK action requires lock_target";
+	if (event->lock_type == SIMULA_LOCK_LWLOCK &&
+		event->lock_mode != ShareLock && event->lock_mode != ExclusiveLock)
+		return "LWLock target supports only ShareLock and ExclusiveLock";
+	if (event->period < 0 || event->active < 0 ||
+		(event->period > 0 && event->active > event->period))
+		return "active must be between 0 and period";
+	if (strcmp(event->operation, SIMULA_OP_SYNCREP_WAIT) == 0 &&
+		event->action != SIMULA_ACTION_WAIT)
+		return "SYNCREP WAIT event supports only WAIT action";
+	if (strcmp(event->operation, SIMULA_OP_REPLAY) == 0 &&
+		event->action != SIMULA_ACTION_WAIT)
+		return "REPLAY event supports only WAIT action";
+	if (event->queryid != 0 &&
+		(OidIsValid(event->relid) ||
+		 strcmp(event->operation, SIMULA_OP_PAGE_READ) == 0 ||
+		 strcmp(event->operation, SIMULA_OP_WAL_FLUSH) == 0 ||
+		 strcmp(event->operation, SIMULA_OP_SYNCREP_WAIT) == 0 ||
+		 strcmp(event->operation, SIMULA_OP_REPLAY) == 0 ||
+		 strcmp(event->operation, SIMULA_OP_PARALLEL_WORKER) == 0))
+		return "event for a query identifier cannot have a relation or a pseudo operation";
+	if (event->skip < 0 || event->times < 0)
+		return "skip and times must not be negative";
+
+	return NULL;
 }
 
+/*
+ * Initialize the event for the operation and the action with the defaults of
+ * the columns of simula_events. The event is for all databases.
+ */
 static void
-pg_simula_xact_callback(XactEvent event, void *arg)
+initEvent(SimulaEvent *event, SimulaSource source, const char *operation,
+		  const char *action)
 {
-	in_simula_event_progress = false;
+	int		act = lookupAction(action);
+	int		i;
+
+	if (act < 0)
+		ereport(ERROR, (errmsg("invalid action: \"%s\"", action)));
+
+	memset(event, 0, sizeof(SimulaEvent));
+	event->source = source;
+	event->dbid = InvalidOid;
+	for (i = 0; i < NAMEDATALEN - 1 && operation[i] != '\0'; i++)
+		event->operation[i] = pg_toupper((unsigned char) operation[i]);
+	event->operation[i] = '\0';
+	event->action = (SimulaAction) act;
+	event->distribution = SIMULA_DIST_FIXED;
+	event->probability = 1.0;
+	event->last_block = -1;
+	event->start_at = DT_NOBEGIN;
+	event->stop_at = DT_NOEND;
+	event->lock_mode = ExclusiveLock;
 }
 
 /*
- * Detect SQL command other than utility commands.
+ * Check the event given by the arguments of add_simula_event() in the same
+ * way as loading the table, but raise an error instead of ignoring it. The
+ * arguments that the function of an old version doesn't have take the
+ * defaults of the columns.
  */
-static PlannedStmt *
-pg_simula_planner(Query *parse, int cursorOptions, ParamListInfo boundParams)
+static void
+checkEventArgs(FunctionCallInfo fcinfo)
 {
-	const char	*commandTag;
+	SimulaEvent	event;
+	const char *problem = NULL;
 
-	commandTag = CreateCommandTag((Node *) &parse->type);
+#define EVENT_ARG_GIVEN(col)	(PG_NARGS() > (col))
 
-	/* Register callback function if not yet */
-	if (!registered_to_callback)
+	initEvent(&event, SIMULA_SOURCE_TABLE,
+			  text_to_cstring(PG_GETARG_TEXT_PP(EVENT_COL_OPERATION)),
+			  text_to_cstring(PG_GETARG_TEXT_PP(EVENT_COL_ACTION)));
+	event.dbid = MyDatabaseId;
+
+	event.usec = (int64) PG_GETARG_INT32(EVENT_COL_SEC) * USECS_PER_SEC;
+	if (EVENT_ARG_GIVEN(EVENT_COL_USEC))
+		event.usec += PG_GETARG_INT64(EVENT_COL_USEC);
+
+	if (EVENT_ARG_GIVEN(EVENT_COL_DISTRIBUTION))
 	{
-		RegisterXactCallback(pg_simula_xact_callback, NULL);
-		registered_to_callback = true;
+		char   *dist_str = text_to_cstring(PG_GETARG_TEXT_PP(EVENT_COL_DISTRIBUTION));
+		int		dist = lookupDistribution(dist_str);
+
+		if (dist < 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid distribution: \"%s\"", dist_str)));
+		event.distribution = (SimulaDistribution) dist;
 	}
+	if (EVENT_ARG_GIVEN(EVENT_COL_JITTER))
+		event.jitter = PG_GETARG_INT64(EVENT_COL_JITTER);
+	if (EVENT_ARG_GIVEN(EVENT_COL_SHAPE))
+		event.shape = PG_GETARG_FLOAT8(EVENT_COL_SHAPE);
+	if (EVENT_ARG_GIVEN(EVENT_COL_PROBABILITY))
+		event.probability = PG_GETARG_FLOAT8(EVENT_COL_PROBABILITY);
+	if (EVENT_ARG_GIVEN(EVENT_COL_RELATION))
+		event.relid = PG_GETARG_OID(EVENT_COL_RELATION);
+	if (EVENT_ARG_GIVEN(EVENT_COL_FIRST_BLOCK))
+		event.first_block = PG_GETARG_INT64(EVENT_COL_FIRST_BLOCK);
+	if (EVENT_ARG_GIVEN(EVENT_COL_LAST_BLOCK))
+		event.last_block = PG_GETARG_INT64(EVENT_COL_LAST_BLOCK);
+	if (EVENT_ARG_GIVEN(EVENT_COL_RATE))
+		event.rate = PG_GETARG_FLOAT8(EVENT_COL_RATE);
+	if (EVENT_ARG_GIVEN(EVENT_COL_START_AT))
+		event.start_at = PG_GETARG_TIMESTAMPTZ(EVENT_COL_START_AT);
+	if (EVENT_ARG_GIVEN(EVENT_COL_STOP_AT))
+		event.stop_at = PG_GETARG_TIMESTAMPTZ(EVENT_COL_STOP_AT);
+	if (EVENT_ARG_GIVEN(EVENT_COL_PERIOD))
+		event.period = intervalToUsec(PG_GETARG_INTERVAL_P(EVENT_COL_PERIOD));
+	if (EVENT_ARG_GIVEN(EVENT_COL_ACTIVE))
+		event.active = intervalToUsec(PG_GETARG_INTERVAL_P(EVENT_COL_ACTIVE));
+	if (EVENT_ARG_GIVEN(EVENT_COL_QUERYID))
+		event.queryid = PG_GETARG_INT64(EVENT_COL_QUERYID);
+	if (EVENT_ARG_GIVEN(EVENT_COL_SKIP))
+		event.skip = PG_GETARG_INT64(EVENT_COL_SKIP);
+	if (EVENT_ARG_GIVEN(EVENT_COL_TIMES))
+		event.times = PG_GETARG_INT64(EVENT_COL_TIMES);
+	if (EVENT_ARG_GIVEN(EVENT_COL_ROLE))
+		event.roleid = PG_GETARG_OID(EVENT_COL_ROLE);
+	if (EVENT_ARG_GIVEN(EVENT_COL_DATABASE))
+		event.datid = PG_GETARG_OID(EVENT_COL_DATABASE);
+	if (EVENT_ARG_GIVEN(EVENT_COL_APPLICATION_NAME))
+	{
+		char   *appname = text_to_cstring(PG_GETARG_TEXT_PP(EVENT_COL_APPLICATION_NAME));
 
-	if (needReloadAndEvent(commandTag))
+		if (strlen(appname) >= NAMEDATALEN)
+			ereport(ERROR,
+					(errcode(ERRCODE_NAME_TOO_LONG),
+					 errmsg("application_name must be shorter than %d characters",
+							NAMEDATALEN)));
+		strlcpy(event.appname, appname, NAMEDATALEN);
+	}
+	if (EVENT_ARG_GIVEN(EVENT_COL_SIZE_MB))
+		event.size_mb = PG_GETARG_INT32(EVENT_COL_SIZE_MB);
+	if (EVENT_ARG_GIVEN(EVENT_COL_LOCK_MODE))
+		problem = parseLockMode(&event,
+								text_to_cstring(PG_GETARG_TEXT_PP(EVENT_COL_LOCK_MODE)));
+	if (problem == NULL && EVENT_ARG_GIVEN(EVENT_COL_LOCK_TARGET))
+		problem = parseLockTarget(&event,
+								  text_to_cstring(PG_GETARG_TEXT_PP(EVENT_COL_LOCK_TARGET)),
+								  true);
+
+#undef EVENT_ARG_GIVEN
+
+	if (problem == NULL)
+		problem = checkEvent(&event);
+	if (problem != NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("%s", problem)));
+}
+
+/* Return the index of the given database in the shared catalog, or -1 */
+static int
+loadedDatabaseIndex(Oid dbid)
+{
+	int	i;
+
+	for (i = 0; i < simula_state->ndatabases; i++)
 	{
-		/* in_simulat_event_progress is turned off at end of the transaction */
-		in_simula_event_progress = true;
-		reloadEventTableData();
-		doEventIfAny(commandTag);
-		in_simula_event_progress = false;
+		if (simula_state->databases[i].dbid == dbid)
+			return i;
 	}
 
-	if (prev_planner)
-        return (*prev_planner) (parse, cursorOptions, boundParams);
-    else
-		return standard_planner(parse, cursorOptions, boundParams);
+	return -1;
 }
 
+/*
+ * Warn that the shared catalog has no room for the current database, which
+ * goes without the events of its table. We warn only once per backend.
+ */
 static void
-pg_simula_ProcessUtility(PlannedStmt *pstmt,
-						 const char *queryString,
-						 ProcessUtilityContext context,
-						 ParamListInfo params,
-						 QueryEnvironment *queryEnv,
-						 DestReceiver *dest,
-						 char *completionTag)
+warnNoRoom(void)
 {
-	Node	*parsetree = pstmt->utilityStmt;
-	const char *commandTag;
+	if (warned_no_room)
+		return;
 
-	commandTag = CreateCommandTag(parsetree);
+	ereport(WARNING,
+			(errmsg("pg_simula could not load the simulation events of database %u",
+					MyDatabaseId),
+			 errdetail("The events of %d databases are already loaded.",
+					   max_databases),
+			 errhint("Consider increasing pg_simula.max_databases.")));
+	warned_no_room = true;
+}
 
-	/* Register callback function if not yet */
-	if (!registered_to_callback)
+/* Return true if the two events are the same event of simula_events */
+static bool
+sameEventKey(const SimulaEvent *a, const SimulaEvent *b)
+{
+	return a->source == b->source && a->dbid == b->dbid &&
+		a->relid == b->relid && a->queryid == b->queryid &&
+		a->datid == b->datid && strcmp(a->operation, b->operation) == 0;
+}
+
+/*
+ * Reset the statistics of the given slot. The occurrences are not statistics
+ * but the state of skip and times, so they are left alone.
+ */
+static void
+resetSlotStats(SimulaSlot *slot)
+{
+	pg_atomic_write_u64(&slot->stats.matches, 0);
+	pg_atomic_write_u64(&slot->stats.fires, 0);
+	pg_atomic_write_u64(&slot->stats.errors, 0);
+	pg_atomic_write_u64(&slot->stats.total_delay, 0);
+	pg_atomic_write_u64(&slot->stats.max_delay, 0);
+}
+
+/* Make the key of the event within its source and database */
+static void
+makeSlotKey(const SimulaEvent *event, SimulaSlotKey *key)
+{
+	memset(key, 0, sizeof(SimulaSlotKey));
+	strlcpy(key->operation, event->operation, NAMEDATALEN);
+	key->relid = event->relid;
+	key->queryid = event->queryid;
+	key->datid = event->datid;
+}
+
+/*
+ * Build a temporary index of the given events by their keys in the given
+ * memory context, so that replaceSharedEvents() finds the slot of each
+ * event without comparing all the pairs. Return NULL if there is no event.
+ */
+static HTAB *
+indexEvents(SimulaEvent *events, int nevents, MemoryContext cxt)
+{
+	HASHCTL	ctl;
+	HTAB   *index;
+	int		i;
+
+	if (nevents == 0)
+		return NULL;
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(SimulaSlotKey);
+	ctl.entrysize = sizeof(SimulaIndexEntry);
+	ctl.hcxt = cxt;
+	index = hash_create("pg_simula published events", nevents, &ctl,
+						HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	for (i = 0; i < nevents; i++)
 	{
-		RegisterXactCallback(pg_simula_xact_callback, NULL);
-		registered_to_callback = true;
+		SimulaIndexEntry *entry;
+		SimulaSlotKey key;
+
+		makeSlotKey(&events[i], &key);
+		entry = hash_search(index, &key, HASH_ENTER, NULL);
+		entry->slot = -1;
 	}
 
-	if (needReloadAndEvent(commandTag))
+	return index;
+}
+
+/*
+ * Replace the events of the given source and database in the shared catalog
+ * with the given events, indexed by indexEvents(). The caller must hold the
+ * lock exclusively. Return false if not all of the events could be stored.
+ *
+ * An event that exists both before and after keeps its slot, and hence
+ * its statistics and occurrences. The slots are recorded in the index, so
+ * it can be used only once.
+ */
+static bool
+replaceSharedEvents(SimulaSource source, Oid dbid,
+					SimulaEvent *events, int nevents, HTAB *index)
+{
+	SimulaSlotKey key;
+	int		next = 0;
+	int		i;
+
+	/* Keep the slots of the old events given again, and free the others */
+	for (i = 0; i < simula_state->nslots; i++)
 	{
-		/* in_simulat_event_progress is turned off at end of the transaction */
-		in_simula_event_progress = true;
-		reloadEventTableData();
-		doEventIfAny(commandTag);
-		in_simula_event_progress = false;
+		SimulaSlot *slot = &(simula_state->slots[i]);
+		SimulaIndexEntry *entry = NULL;
+
+		if (!slot->in_use || slot->event.source != source ||
+			slot->event.dbid != dbid)
+			continue;
+
+		if (nevents > 0)
+		{
+			makeSlotKey(&(slot->event), &key);
+			entry = hash_search(index, &key, HASH_FIND, NULL);
+		}
+
+		if (entry != NULL && entry->slot < 0)
+			entry->slot = i;
+		else
+			slot->in_use = false;
 	}
 
-    /* Call the standard process utility chain. */
-    if (prev_ProcessUtility)
-        (*prev_ProcessUtility) (pstmt, queryString, context, params,
-                                     queryEnv, dest, completionTag);
-    else
-        standard_ProcessUtility(pstmt, queryString, context, params,
-                                queryEnv, dest, completionTag);
+	for (i = 0; i < nevents; i++)
+	{
+		SimulaIndexEntry *entry;
+		SimulaSlot *slot;
+
+		makeSlotKey(&events[i], &key);
+		entry = hash_search(index, &key, HASH_FIND, NULL);
+		Assert(entry != NULL);
+
+		if (entry->slot >= 0)
+		{
+			slot = &(simula_state->slots[entry->slot]);
+			if (slot->event.skip != events[i].skip ||
+				slot->event.times != events[i].times)
+				pg_atomic_write_u64(&slot->occurrences, 0);
+		}
+		else
+		{
+			/* Otherwise, get an unused slot */
+			while (next < simula_state->nslots &&
+				   simula_state->slots[next].in_use)
+				next++;
+
+			if (next == simula_state->nslots)
+			{
+				if (simula_state->nslots >= max_events)
+					return false;
+				simula_state->nslots++;
+			}
+
+			slot = &(simula_state->slots[next]);
+			entry->slot = next;
+			resetSlotStats(slot);
+			pg_atomic_write_u64(&slot->throttle_tat, 0);
+			pg_atomic_write_u64(&slot->occurrences, 0);
+			slot->in_use = true;
+		}
+
+		slot->event = events[i];
+	}
+
+	return true;
+}
+
+/*
+ * Tell the backends that the shared catalog has been changed. The scenario
+ * worker is woken up as well to control the replay by a new REPLAY event at
+ * once. The caller must hold the lock exclusively.
+ */
+static void
+catalogChanged(void)
+{
+	pg_atomic_fetch_add_u64(&simula_state->generation, 1);
+
+	if (simula_state->worker_latch != NULL &&
+		simula_state->worker_latch != MyLatch)
+		SetLatch(simula_state->worker_latch);
 }
 
 /*
- * Always reject the connection.
+ * Replace the events of the given database in the shared catalog with the
+ * given events, read from the table at read_at and indexed by indexEvents(),
+ * and mark the database as loaded.
+ *
+ * If if_generation is not 0, we do nothing unless the catalog is still of
+ * that generation, taken before the table was read. Otherwise a transaction
+ * committed after our snapshot might have published or unloaded the
+ * database in the meantime.
  *
- * This function is a copy function from auth_failed(auth.c)
+ * This is called at commit, so we must not raise an error.
  */
 static void
-pg_simula_ClientAuthentication(Port *port, int status)
+publishEventTableData(Oid dbid, SimulaEvent *events, int nevents,
+					  HTAB *index, TimestampTz read_at, uint64 if_generation)
 {
-	const char *errstr;
-	int			errcode_return = ERRCODE_INVALID_AUTHORIZATION_SPECIFICATION;
+	int		idx;
+	bool	no_room = false;
+	bool	overflow = false;
+
+	LWLockAcquire(simula_state->lock, LW_EXCLUSIVE);
 
-	if (!connection_refused)
+	if (if_generation != 0 &&
+		pg_atomic_read_u64(&simula_state->generation) != if_generation)
+	{
+		LWLockRelease(simula_state->lock);
 		return;
+	}
 
-	/*
-	 * If we failed due to EOF from client, just quit; there's no point in
-	 * trying to send a message to the client, and not much point in logging
-	 * the failure in the postmaster log.  (Logging the failure might be
-	 * desirable, were it not for the fact that libpq closes the connection
-	 * unceremoniously if challenged for a password when it hasn't got one to
-	 * send.  We'll get a useless log entry for every psql connection under
-	 * password auth, even if it's perfectly successful, if we log STATUS_EOF
-	 * events.)
-	 */
-	if (status == STATUS_EOF)
-		proc_exit(0);
+	idx = loadedDatabaseIndex(dbid);
+	if (idx < 0 && simula_state->ndatabases >= max_databases)
+		no_room = true;
+	else
+	{
+		if (idx < 0)
+		{
+			idx = simula_state->ndatabases++;
+			simula_state->databases[idx].dbid = dbid;
+		}
+		simula_state->databases[idx].loaded_at = read_at;
 
-	errstr = gettext_noop("authentication failed by pg_simula");
+		if (!replaceSharedEvents(SIMULA_SOURCE_TABLE, dbid,
+								 events, nevents, index))
+			overflow = true;
 
-	ereport(FATAL,
-			(errcode(errcode_return),
-			 errmsg(errstr, port->user_name), 0));
-	/* doesn't return */
+		catalogChanged();
+	}
+
+	LWLockRelease(simula_state->lock);
+
+	if (no_room)
+		warnNoRoom();
+	if (overflow)
+		ereport(WARNING,
+				(errmsg("pg_simula could not load all simulation events"),
+				 errhint("Consider increasing pg_simula.max_events.")));
 }
 
+/*
+ * Remove the events of the given database from the shared catalog and mark
+ * the database as not loaded, so that the table is read again by the next
+ * statement if any.
+ *
+ * This is called at commit, so we must not raise an error.
+ */
 static void
-doEventIfAny(const char *commandTag)
+unloadDatabase(Oid dbid)
 {
-	ListCell	*cell;
+	int		idx;
+
+	LWLockAcquire(simula_state->lock, LW_EXCLUSIVE);
+
+	idx = loadedDatabaseIndex(dbid);
+	if (idx >= 0)
+	{
+		simula_state->databases[idx] =
+			simula_state->databases[--simula_state->ndatabases];
+		replaceSharedEvents(SIMULA_SOURCE_TABLE, dbid, NULL, 0, NULL);
+	}
+
+	/* Even if not loaded, someone might be reading the table now */
+	catalogChanged();
+
+	LWLockRelease(simula_state->lock);
+}
+
+/*
+ * Replace the events given by the scenario worker, which are for all
+ * databases.
+ */
+static void
+publishScenarioEvents(SimulaSource source, SimulaEvent *events, int nevents)
+{
+	HTAB   *index = indexEvents(events, nevents, CurrentMemoryContext);
+	bool	overflow;
+
+	LWLockAcquire(simula_state->lock, LW_EXCLUSIVE);
+	overflow = !replaceSharedEvents(source, InvalidOid, events, nevents, index);
+	catalogChanged();
+	LWLockRelease(simula_state->lock);
+
+	if (index != NULL)
+		hash_destroy(index);
+
+	if (overflow)
+		ereport(WARNING,
+				(errmsg("pg_simula could not load all simulation events"),
+				 errhint("Consider increasing pg_simula.max_events.")));
+}
+
+/*
+ * Copy the events of the current database and the events for all databases
+ * from the shared catalog into SimulaEvents. Return false if the database
+ * is not loaded yet, or has been loaded before we saw simula_events changed.
+ */
+static bool
+copySharedEvents(void)
+{
+	HASHCTL	ctl;
+	bool	loaded;
+	int		idx;
+	int		i;
+
+	/* Our statistics refer to the entries being destroyed */
+	flushEventStats();
+
+	/* The filters are computed for the current session below */
+	FilterUserId = GetUserId();
+	strlcpy(FilterAppName, application_name ? application_name : "",
+			NAMEDATALEN);
+
+	if (SimulaEvents != NULL)
+		hash_destroy(SimulaEvents);
+	if (SimulaQueryEvents != NULL)
+		hash_destroy(SimulaQueryEvents);
+	SimulaEventsValid = false;
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(SimulaEventKey);
+	ctl.entrysize = sizeof(SimulaEventEntry);
+	SimulaEvents = hash_create("pg_simula events", 64, &ctl,
+							   HASH_ELEM | HASH_BLOBS);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(int64);
+	ctl.entrysize = sizeof(SimulaQueryEntry);
+	SimulaQueryEvents = hash_create("pg_simula query events", 16, &ctl,
+									HASH_ELEM | HASH_BLOBS);
+	SimulaEventsHaveRelations = false;
+	SimulaEventsHavePageReads = false;
+	SimulaEventsHaveFilters = false;
 
-	foreach(cell, SimulaEvents)
+	LWLockAcquire(simula_state->lock, LW_SHARED);
+
+	/* The table might have been changed after the database was loaded */
+	idx = loadedDatabaseIndex(MyDatabaseId);
+	loaded = (idx >= 0 &&
+			  simula_state->databases[idx].loaded_at >= SimulaTableChangedAt);
+
+	for (i = 0; i < simula_state->nslots; i++)
 	{
-		SimulaEvent *event = lfirst(cell);
+		SimulaEvent *event = &(simula_state->slots[i].event);
+		SimulaEventEntry *entry;
+		SimulaEventKey key;
+		bool	found;
+
+		if (!simula_state->slots[i].in_use ||
+			(event->dbid != MyDatabaseId && OidIsValid(event->dbid)) ||
+			(event->datid != MyDatabaseId && OidIsValid(event->datid)))
+			continue;
+
+		memset(&key, 0, sizeof(key));
+		strlcpy(key.operation, event->operation, NAMEDATALEN);
+		key.relid = event->relid;
+		key.queryid = event->queryid;
 
-		/* Found the target, do specified action */
-		if (pg_strcasecmp(event->operation, commandTag) == 0)
+		/*
+		 * Expected to be at most one action per command and relation in each
+		 * source. The event in the table of the database takes precedence
+		 * over the one for all databases.
+		 */
+		entry = hash_search(SimulaEvents, &key, HASH_ENTER, &found);
+		if (!found || (event->source == SIMULA_SOURCE_TABLE &&
+					   entry->event.source != SIMULA_SOURCE_TABLE))
 		{
-			Action *act = ActionTable;
+			if (OidIsValid(event->relid))
+				SimulaEventsHaveRelations = true;
+			if (strcmp(event->operation, SIMULA_OP_PAGE_READ) == 0)
+				SimulaEventsHavePageReads = true;
 
-			/* Walk through ActionTable in order to find the action function */
-			for (act = ActionTable; act->action != NULL; act++)
+			entry->func = ActionTable[event->action].func;
+			entry->slot = i;
+			entry->event = *event;
+			entry->dirty = false;
+			memset(&entry->stats, 0, sizeof(SimulaLocalStats));
+
+			/* The window is computed when the event is looked up first */
+			entry->scheduled = (event->start_at != DT_NOBEGIN ||
+								event->stop_at != DT_NOEND ||
+								event->period > 0);
+			entry->in_window = true;
+			entry->toggle_at = DT_NOBEGIN;
+
+			entry->applies = eventApplies(event);
+			if (OidIsValid(event->roleid) || event->appname[0] != '\0')
+				SimulaEventsHaveFilters = true;
+
+			/* A replaced entry is already linked */
+			if (!found)
 			{
-				if (pg_strcasecmp(act->action, event->action) == 0)
+				entry->next_query = NULL;
+
+				if (event->queryid != 0)
 				{
-					/* expected to be at most one action per command */
-					act->func(event->sec);
-					return;
+					SimulaQueryEntry *qentry;
+
+					qentry = hash_search(SimulaQueryEvents, &event->queryid,
+										 HASH_ENTER, &found);
+					if (found)
+						entry->next_query = qentry->events;
+					qentry->events = entry;
 				}
 			}
 		}
 	}
+
+	if (loaded)
+	{
+		SimulaEventsValid = true;
+		SimulaTableChangedAt = 0;
+	}
+
+	SimulaEventsGeneration = pg_atomic_read_u64(&simula_state->generation);
+
+	LWLockRelease(simula_state->lock);
+
+	return loaded;
 }
 
+/*
+ * Make SimulaEvents up-to-date. We get the events from the shared catalog
+ * only when it has been changed since the last time, and read the table
+ * only when the current database is not loaded to the shared catalog yet,
+ * or loaded before we saw the table changed, and pg_simula is created on it.
+ */
 static void
-error_func(int sec)
+reloadEventTableData(void)
 {
-	ereport(ERROR, (errmsg("simulation of ERROR by pg_simula")));
+	SimulaEvent *events;
+	HTAB   *index;
+	TimestampTz	read_at;
+	uint64	generation;
+	int		nevents;
+	bool	no_room;
+
+	if (SimulaEventsValid && SimulaTableChangedAt == 0 &&
+		SimulaEventsGeneration == pg_atomic_read_u64(&simula_state->generation))
+	{
+		checkEventFilters();
+		return;
+	}
+
+	/* Our relcache callback needs to know which relation is the table */
+	eventTableRelid();
+
+	if (copySharedEvents())
+		return;
+
+	/*
+	 * Parallel workers cannot read the table, but the leader must have
+	 * loaded the database before starting them anyway.
+	 */
+	if (IsParallelWorker() || !isPgSimulaLoaded())
+	{
+		/*
+		 * Remember that there is no event on this database until the catalog
+		 * is changed. Since creating the extension unloads the database at
+		 * commit, we will notice it by the generation.
+		 */
+		SimulaEventsValid = true;
+		SimulaTableChangedAt = 0;
+		return;
+	}
+
+	/*
+	 * Don't read the table if the catalog has no room for the database.
+	 * Without the events of the table, we don't read it again until the
+	 * catalog is changed.
+	 */
+	LWLockAcquire(simula_state->lock, LW_SHARED);
+	no_room = (loadedDatabaseIndex(MyDatabaseId) < 0 &&
+			   simula_state->ndatabases >= max_databases);
+	LWLockRelease(simula_state->lock);
+
+	if (no_room)
+	{
+		warnNoRoom();
+		SimulaEventsValid = true;
+		SimulaTableChangedAt = 0;
+		return;
+	}
+
+	read_at = GetCurrentTimestamp();
+	generation = pg_atomic_read_u64(&simula_state->generation);
+	events = fetchEventTableData(CurrentMemoryContext, &nevents);
+	index = indexEvents(events, nevents, CurrentMemoryContext);
+	publishEventTableData(MyDatabaseId, events, nevents, index,
+						  read_at, generation);
+	if (index != NULL)
+		hash_destroy(index);
+	if (events)
+		pfree(events);
+
+	copySharedEvents();
 }
 
+/*
+ * Read simula_events table modified by the current transaction. The read
+ * events are published to the shared catalog at commit if we have locked
+ * the table. Otherwise the database is just unloaded at commit.
+ */
 static void
-panic_func(int sec)
+stageEventTableData(void)
 {
-	ereport(PANIC, (errmsg("simulation of PANIC by pg_simula")));
+	in_simula_event_progress = true;
+
+	if (pending_index)
+		hash_destroy(pending_index);
+	if (pending_events)
+		pfree(pending_events);
+	pending_index = NULL;
+	pending_events = NULL;
+	pending_nevents = 0;
+
+	pending_loaded = (event_table_locked && isPgSimulaLoaded());
+	if (pending_loaded)
+	{
+		/* Rolling back to a savepoint might have released the lock */
+		lockEventTable();
+
+		pending_read_at = GetCurrentTimestamp();
+		pending_events = fetchEventTableData(TopMemoryContext,
+											 &pending_nevents);
+		pending_index = indexEvents(pending_events, pending_nevents,
+									TopMemoryContext);
+	}
+	pending_valid = true;
+
+	in_simula_event_progress = false;
 }
 
-static void
-wait_func(int sec)
+Datum
+add_simula_event(PG_FUNCTION_ARGS)
 {
-	pg_usleep(sec * 1000 * 1000);
+	int		nargs = PG_NARGS();
+	Oid		argtypes[NUM_EVENT_COLUMNS];
+	Datum	values[NUM_EVENT_COLUMNS];
+	StringInfoData	values_list;
+	int		ret;
+	int		i;
+
+	if (simula_state == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_simula must be loaded via shared_preload_libraries")));
+
+	/* The arguments other than the first three are available since 1.1 */
+	if (nargs > NUM_EVENT_COLUMNS)
+		elog(ERROR, "unexpected number of arguments: %d", nargs);
+
+	in_simula_event_progress = true;
+
+	checkEventArgs(fcinfo);
+
+	for (i = 0; i < nargs; i++)
+	{
+		argtypes[i] = EventColumns[i].type;
+		values[i] = PG_GETARG_DATUM(i);
+	}
+
+	/* Build the upsert statement for the given columns */
+	initStringInfo(&values_list);
+	appendStringInfoString(&values_list, "VALUES (");
+	for (i = 0; i < nargs; i++)
+		appendStringInfo(&values_list, "%s$%d", i > 0 ? ", " : "", i + 1);
+	appendStringInfoChar(&values_list, ')');
+
+	ret = upsertEvents(nargs, false, values_list.data, nargs, argtypes, values);
+
+	in_simula_event_progress = false;
+
+	PG_RETURN_BOOL(ret);
 }
 
-static void
-fatal_func(int sec)
-{
+/*
+ * Add simulation events given by the arrays of operations, actions and
+ * wait times in one statement.
+ */
+Datum
+add_simula_events(PG_FUNCTION_ARGS)
+{
+	ArrayType  *operations = PG_GETARG_ARRAYTYPE_P(0);
+	ArrayType  *actions = PG_GETARG_ARRAYTYPE_P(1);
+	ArrayType  *secs = PG_GETARG_ARRAYTYPE_P(2);
+	Datum	   *operation_datums;
+	bool	   *operation_nulls;
+	Datum	   *action_datums;
+	bool	   *action_nulls;
+	Datum	   *sec_datums;
+	bool	   *sec_nulls;
+	int			noperations;
+	int			nactions;
+	int			nsecs;
+	Oid			argtypes[3] = {TEXTARRAYOID, TEXTARRAYOID, INT4ARRAYOID};
+	Datum		values[3];
+	int			ret;
+	int			i;
+
+	if (simula_state == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_simula must be loaded via shared_preload_libraries")));
+
+	deconstruct_array(operations, TEXTOID, -1, false, 'i',
+					  &operation_datums, &operation_nulls, &noperations);
+	deconstruct_array(actions, TEXTOID, -1, false, 'i',
+					  &action_datums, &action_nulls, &nactions);
+	deconstruct_array(secs, INT4OID, sizeof(int32), true, 'i',
+					  &sec_datums, &sec_nulls, &nsecs);
+
+	if (noperations != nactions || nsecs != nactions)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("arrays must have the same number of elements")));
+
+	in_simula_event_progress = true;
+
+	for (i = 0; i < nactions; i++)
+	{
+		SimulaEvent	event;
+		const char *problem;
+
+		if (operation_nulls[i] || action_nulls[i] || sec_nulls[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("arrays must not contain nulls")));
+
+		/* The other columns take the defaults */
+		initEvent(&event, SIMULA_SOURCE_TABLE,
+				  TextDatumGetCString(operation_datums[i]),
+				  TextDatumGetCString(action_datums[i]));
+		event.dbid = MyDatabaseId;
+		event.usec = (int64) DatumGetInt32(sec_datums[i]) * USECS_PER_SEC;
+
+		if ((problem = checkEvent(&event)) != NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("%s", problem)));
+	}
+
+	values[0] = PointerGetDatum(operations);
+	values[1] = PointerGetDatum(actions);
+	values[2] = PointerGetDatum(secs);
+
+	/* The other columns of the existing events are reset as well */
+	ret = upsertEvents(3, true, "SELECT * FROM unnest($1, $2, $3)",
+					   3, argtypes, values);
+
+	in_simula_event_progress = false;
+
+	PG_RETURN_BOOL(ret);
+}
+
+/*
+ * Add simulation events given by an array of rows of simula_events in one
+ * statement. The rows are checked in the same way as loading the table, but
+ * an invalid one raises an error instead of being ignored.
+ */
+Datum
+add_simula_event_rows(PG_FUNCTION_ARGS)
+{
+	Oid			argtype = get_fn_expr_argtype(fcinfo->flinfo, 0);
+	Oid			elemtype = get_element_type(argtype);
+	ArrayType  *rows = PG_GETARG_ARRAYTYPE_P(0);
+	Datum		value = PointerGetDatum(rows);
+	Datum	   *row_datums;
+	bool	   *row_nulls;
+	int			nrows;
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+	TupleDesc	tupdesc;
+	StringInfoData select_list;
+	int			ret;
+	int			i;
+
+	if (simula_state == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_simula must be loaded via shared_preload_libraries")));
+
+	get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+	deconstruct_array(rows, elemtype, typlen, typbyval, typalign,
+					  &row_datums, &row_nulls, &nrows);
+
+	in_simula_event_progress = true;
+
+	tupdesc = lookup_rowtype_tupdesc(elemtype, -1);
+	for (i = 0; i < nrows; i++)
+	{
+		HeapTupleHeader td;
+		HeapTupleData tuple;
+		SimulaEvent	event;
+		const char *problem;
+
+		if (row_nulls[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("array must not contain nulls")));
+
+		td = DatumGetHeapTupleHeader(row_datums[i]);
+		tuple.t_len = HeapTupleHeaderGetDatumLength(td);
+		ItemPointerSetInvalid(&(tuple.t_self));
+		tuple.t_tableOid = InvalidOid;
+		tuple.t_data = td;
+
+		if ((problem = tupleToEvent(&tuple, tupdesc, &event)) != NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("%s", problem)));
+	}
+	ReleaseTupleDesc(tupdesc);
+
+	initStringInfo(&select_list);
+	appendStringInfoString(&select_list, "SELECT ");
+	for (i = 0; i < NUM_EVENT_COLUMNS; i++)
+		appendStringInfo(&select_list, "%se.%s", i > 0 ? ", " : "",
+						 EventColumns[i].name);
+	appendStringInfoString(&select_list, " FROM unnest($1) e");
+
+	ret = upsertEvents(NUM_EVENT_COLUMNS, false, select_list.data,
+					   1, &argtype, &value);
+
+	in_simula_event_progress = false;
+
+	PG_RETURN_BOOL(ret);
+}
+
+/*
+ * Lock simula_events until the end of the transaction against the other
+ * transactions modifying the events. Each of them publishes the whole table
+ * of the database at commit, so two of them running concurrently would lose
+ * the events of the one committed first. The lock doesn't block readers.
+ *
+ * The transactions modifying the table directly don't take the lock, and so
+ * only unload the database at commit.
+ */
+static void
+lockEventTable(void)
+{
+	RangeVarGetRelid(makeRangeVar("public", EVENT_TABLE_NAME, -1),
+					 ShareRowExclusiveLock, false);
+	event_table_locked = true;
+}
+
+/*
+ * Return the OID of simula_events of the current database, or InvalidOid if
+ * pg_simula is not created on it.
+ */
+static Oid
+eventTableRelid(void)
+{
+	if (!OidIsValid(SimulaTableRelid))
+		SimulaTableRelid = get_relname_relid(EVENT_TABLE_NAME,
+											 PG_PUBLIC_NAMESPACE);
+
+	return SimulaTableRelid;
+}
+
+/*
+ * Remember that the current transaction modifies simula_events, so that the
+ * table is published at commit. Modifying rows doesn't invalidate the
+ * relcache entry of the table, so we do it here for the sessions on a
+ * standby, where the invalidation is replayed at commit; see
+ * pg_simula_relcache_callback().
+ */
+static void
+noteEventTableChange(Oid relid)
+{
+	CacheInvalidateRelcacheByRelid(relid);
+	catalog_dirty = true;
+}
+
+/* Check if the utility command is COPY FROM or TRUNCATE of simula_events */
+static bool
+utilityModifiesEventTable(Node *parsetree)
+{
+	List	*rangevars;
+	ListCell	*cell;
+	Oid		relid;
+
+	if (IsA(parsetree, CopyStmt) && ((CopyStmt *) parsetree)->is_from)
+		rangevars = list_make1(((CopyStmt *) parsetree)->relation);
+	else if (IsA(parsetree, TruncateStmt))
+		rangevars = ((TruncateStmt *) parsetree)->relations;
+	else
+		return false;
+
+	if (!OidIsValid(relid = eventTableRelid()))
+		return false;
+
+	foreach(cell, rangevars)
+	{
+		if (RangeVarGetRelid((RangeVar *) lfirst(cell), NoLock, true) == relid)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Insert or update the events in simula_events by one statement. The rows
+ * are given by source, a VALUES list or a SELECT, having the first ncols
+ * columns of EventColumns. If reset is true, the other columns of an
+ * existing event are reset to their defaults, so that the event is replaced
+ * as a whole. The shared catalog is updated once at commit.
+ */
+static int
+upsertEvents(int ncols, bool reset, const char *source,
+			 int nargs, Oid *argtypes, Datum *values)
+{
+	int		nupdate = reset ? NUM_EVENT_COLUMNS : ncols;
+	StringInfoData	buf;
+	bool	first;
+	int		ret;
+	int		i;
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "INSERT INTO %s (", EVENT_TABLE_NAME);
+	for (i = 0; i < ncols; i++)
+		appendStringInfo(&buf, "%s%s", i > 0 ? ", " : "", EventColumns[i].name);
+	appendStringInfo(&buf, ") %s", source);
+	appendStringInfoString(&buf,
+						   " ON CONFLICT ON CONSTRAINT simula_events_pkey "
+						   "DO UPDATE SET (");
+	for (i = 0, first = true; i < nupdate; i++)
+	{
+		if (EventColumns[i].key)
+			continue;
+		appendStringInfo(&buf, "%s%s", first ? "" : ", ", EventColumns[i].name);
+		first = false;
+	}
+	appendStringInfoString(&buf, ") = (");
+	for (i = 0, first = true; i < nupdate; i++)
+	{
+		if (EventColumns[i].key)
+			continue;
+		if (i < ncols)
+			appendStringInfo(&buf, "%sexcluded.%s", first ? "" : ", ",
+							 EventColumns[i].name);
+		else
+			appendStringInfo(&buf, "%sDEFAULT", first ? "" : ", ");
+		first = false;
+	}
+	appendStringInfoChar(&buf, ')');
+
+	lockEventTable();
+
+	SetCurrentStatementStartTimestamp();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	ret = SPI_execute_with_args(buf.data, nargs, argtypes, values, NULL,
+								false, 0);
+	SPI_finish();
+	PopActiveSnapshot();
+
+	/* The shared catalog is updated when committing */
+	registerCallbacks();
+	catalog_dirty = true;
+
+	return ret;
+}
+
+/* Clear all simulation events */
+Datum
+clear_all_events(PG_FUNCTION_ARGS)
+{
+	int ret;
+	StringInfoData buf;
+
+	if (simula_state == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_simula must be loaded via shared_preload_libraries")));
+
+	in_simula_event_progress = true;
+	lockEventTable();
+	SetCurrentStatementStartTimestamp();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "TRUNCATE %s", EVENT_TABLE_NAME);
+
+	ret = SPI_execute(buf.data, false, 0);
+
+	SPI_finish();
+	PopActiveSnapshot();
+
+	/* The shared catalog is updated when committing */
+	registerCallbacks();
+	catalog_dirty = true;
+
+	in_simula_event_progress = false;
+
+    PG_RETURN_BOOL(ret);
+}
+
+/*
+ * Return statistics of all simulation events in the shared catalog.
+ */
+Datum
+pg_simula_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	int		i;
+
+	if (simula_state == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_simula must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(simula_state->lock, LW_SHARED);
+
+	for (i = 0; i < simula_state->nslots; i++)
+	{
+		SimulaSlot *slot = &(simula_state->slots[i]);
+		Datum	values[10];
+		bool	nulls[10];
+		int		j = 0;
+
+		if (!slot->in_use)
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[j++] = ObjectIdGetDatum(slot->event.dbid);
+		values[j++] = CStringGetTextDatum(slot->event.operation);
+		values[j++] = ObjectIdGetDatum(slot->event.relid);
+		values[j++] = Int64GetDatum(slot->event.queryid);
+		values[j++] = CStringGetTextDatum(ActionTable[slot->event.action].action);
+		values[j++] = Int64GetDatum((int64) pg_atomic_read_u64(&slot->stats.matches));
+		values[j++] = Int64GetDatum((int64) pg_atomic_read_u64(&slot->stats.fires));
+		values[j++] = Int64GetDatum((int64) pg_atomic_read_u64(&slot->stats.errors));
+		values[j++] = Int64GetDatum((int64) pg_atomic_read_u64(&slot->stats.total_delay));
+		values[j++] = Int64GetDatum((int64) pg_atomic_read_u64(&slot->stats.max_delay));
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(simula_state->lock);
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/* Reset statistics of all simulation events */
+Datum
+pg_simula_stats_reset(PG_FUNCTION_ARGS)
+{
+	int		i;
+
+	if (simula_state == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_simula must be loaded via shared_preload_libraries")));
+
+	LWLockAcquire(simula_state->lock, LW_SHARED);
+	for (i = 0; i < simula_state->nslots; i++)
+		resetSlotStats(&(simula_state->slots[i]));
+	LWLockRelease(simula_state->lock);
+
+	PG_RETURN_VOID();
+}
+
+/* Check if pg_simula is already loaded (created) on the database */
+static bool
+isPgSimulaLoaded(void)
+{
+	return OidIsValid(get_extension_oid("pg_simula", true));
+}
+
+/* Check if the statement creates, updates or drops pg_simula itself */
+static bool
+isPgSimulaExtensionStmt(Node *parsetree)
+{
+	ListCell   *cell;
+
+	if (IsA(parsetree, CreateExtensionStmt))
+		return strcmp(((CreateExtensionStmt *) parsetree)->extname,
+					  "pg_simula") == 0;
+
+	if (IsA(parsetree, AlterExtensionStmt))
+		return strcmp(((AlterExtensionStmt *) parsetree)->extname,
+					  "pg_simula") == 0;
+
+	if (!IsA(parsetree, DropStmt) ||
+		((DropStmt *) parsetree)->removeType != OBJECT_EXTENSION)
+		return false;
+
+	foreach(cell, ((DropStmt *) parsetree)->objects)
+	{
+		if (strcmp(strVal(lfirst(cell)), "pg_simula") == 0)
+			return true;
+	}
+	return false;
+}
+
+static void
+pg_simula_xact_callback(XactEvent event, void *arg)
+{
+	SimulaEventEntry *entry;
+
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+			if (catalog_dirty)
+				stageEventTableData();
+
+			/* The commit record is flushed unless committing asynchronously */
+			if (XactSynchronousCommit > SYNCHRONOUS_COMMIT_OFF &&
+				(entry = lookupCommitEvent(SIMULA_OP_WAL_FLUSH)) != NULL)
+				doWalFlushEvent(entry);
+
+			/*
+			 * The actual wait for synchronous replication is done after the
+			 * commit record is flushed, while the transaction still holds its
+			 * locks and is seen as running by others. That is the case here
+			 * as well, though the commit record is not written yet.
+			 * Interrupts are held off so that canceling the wait doesn't
+			 * abort the transaction, as it cannot abort the actual one.
+			 */
+			if (SyncRepRequested() &&
+				SyncRepStandbyNames != NULL && SyncRepStandbyNames[0] != '\0' &&
+				(entry = lookupCommitEvent(SIMULA_OP_SYNCREP_WAIT)) != NULL &&
+				entry->event.action == SIMULA_ACTION_WAIT)
+			{
+				HOLD_INTERRUPTS();
+				fireEvent(entry);
+				RESUME_INTERRUPTS();
+			}
+			break;
+
+		case XACT_EVENT_PRE_PREPARE:
+			if (catalog_dirty)
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("cannot PREPARE a transaction that has modified simulation events")));
+			break;
+
+		case XACT_EVENT_COMMIT:
+			if (pending_valid && pending_loaded)
+				publishEventTableData(MyDatabaseId, pending_events,
+									  pending_nevents, pending_index,
+									  pending_read_at, 0);
+			else if (pending_valid)
+				unloadDatabase(MyDatabaseId);
+			if (OidIsValid(pending_drop_dbid))
+				unloadDatabase(pending_drop_dbid);
+			/* fall through */
+
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+		case XACT_EVENT_PARALLEL_ABORT:
+		case XACT_EVENT_PREPARE:
+			/* Queries aborted don't call ExecutorEnd */
+			if (SimulaScans != NIL)
+				releaseScans(NULL, InvalidSubTransactionId);
+			if (SimulaMemoryContext != NULL)
+				MemoryContextReset(SimulaMemoryContext);
+			flushEventStats();
+			if (pending_index)
+				hash_destroy(pending_index);
+			if (pending_events)
+				pfree(pending_events);
+			pending_index = NULL;
+			pending_events = NULL;
+			pending_nevents = 0;
+			pending_valid = false;
+			catalog_dirty = false;
+			event_table_locked = false;
+			pending_drop_dbid = InvalidOid;
+			break;
+
+		default:
+			break;
+	}
+
+	in_simula_event_progress = false;
+}
+
+/*
+ * Forget the events of the queries aborted with the subtransaction, which
+ * don't call ExecutorEnd. The queries of a committed subtransaction belong
+ * to the parent from then on.
+ */
+static void
+pg_simula_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+						   SubTransactionId parentSubid, void *arg)
+{
+	ListCell   *cell;
+
+	if (SimulaScans == NIL)
+		return;
+
+	switch (event)
+	{
+		case SUBXACT_EVENT_ABORT_SUB:
+			releaseScans(NULL, mySubid);
+			break;
+
+		case SUBXACT_EVENT_COMMIT_SUB:
+			foreach(cell, SimulaScans)
+			{
+				SimulaScan *scan = lfirst(cell);
+
+				if (scan->subid == mySubid)
+					scan->subid = parentSubid;
+			}
+			break;
+
+		default:
+			break;
+	}
+}
+
+/*
+ * Notice that simula_events of the current database may have been changed,
+ * or may have been recreated, by the invalidation of the relation or of all
+ * relations. See noteEventTableChange().
+ *
+ * If the current transaction has an XID, it might be the one modifying the
+ * table, so it updates the shared catalog at commit. On a standby, where the
+ * invalidation is replayed, we remember when we noticed it and read the
+ * table again unless someone else has read it since. On a primary, the
+ * transaction modifying the table updates the shared catalog by itself.
+ */
+static void
+pg_simula_relcache_callback(Datum arg, Oid relid)
+{
+	if (OidIsValid(relid) && relid != SimulaTableRelid)
+		return;
+
+	/* Looked up again when needed */
+	SimulaTableRelid = InvalidOid;
+
+	if (IsTransactionState() &&
+		TransactionIdIsValid(GetTopTransactionIdIfAny()))
+		catalog_dirty = true;
+	else if (RecoveryInProgress())
+		SimulaTableChangedAt = GetCurrentTimestamp();
+}
+
+/* Flush the statistics not yet flushed, e.g. when FATAL action is done */
+static void
+pg_simula_shmem_exit(int code, Datum arg)
+{
+	if (simula_state != NULL)
+		flushEventStats();
+}
+
+/* Register callback functions if not yet */
+static void
+registerCallbacks(void)
+{
+	if (registered_to_callback)
+		return;
+
+	RegisterXactCallback(pg_simula_xact_callback, NULL);
+	RegisterSubXactCallback(pg_simula_subxact_callback, NULL);
+	CacheRegisterRelcacheCallback(pg_simula_relcache_callback, (Datum) 0);
+	before_shmem_exit(pg_simula_shmem_exit, (Datum) 0);
+	registered_to_callback = true;
+}
+
+/*
+ * Detect SQL command other than utility commands.
+ *
+ * The event is done at every execution rather than at planning, so that
+ * prepared statements and cached plans are simulated as well. Parallel
+ * workers don't do the event of the statement, which the leader has already
+ * done, but do PARALLEL WORKER event instead so that each worker can be
+ * delayed or failed on its own. The query identifier isn't passed to the
+ * workers.
+ */
+static void
+pg_simula_ExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+	PlannedStmt *pstmt = queryDesc->plannedStmt;
+	const char	*commandTag;
+	bool		simulate;
+	SimulaEventEntry *fired = NULL;
+	SimulaEventEntry throttle;
+
+	commandTag = CreateCommandTag((Node *) pstmt);
+
+	/* Register callback function if not yet */
+	registerCallbacks();
+
+	/* Remember that the shared catalog needs to be updated at commit */
+	if (simula_state != NULL && pstmt->resultRelations != NIL &&
+		(eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0)
+	{
+		Oid		relid = eventTableRelid();
+		ListCell	*cell;
+
+		foreach(cell, pstmt->resultRelations)
+		{
+			if (OidIsValid(relid) &&
+				rt_fetch(lfirst_int(cell), pstmt->rtable)->relid == relid)
+			{
+				noteEventTableChange(relid);
+				break;
+			}
+		}
+	}
+
+	simulate = ((eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0 &&
+				needReloadAndEvent(commandTag));
+
+	if (simulate)
+	{
+		/* in_simulat_event_progress is turned off at end of the transaction */
+		in_simula_event_progress = true;
+		reloadEventTableData();
+		fired = doEventIfAny(IsParallelWorker() ?
+							 SIMULA_OP_PARALLEL_WORKER : commandTag,
+							 SimulaEventsHaveRelations ?
+							 plannedStmtTargetRelations(pstmt) : NIL,
+							 IsParallelWorker() ? 0 : (int64) pstmt->queryId);
+		in_simula_event_progress = false;
+
+		/* Rows are throttled by ExecutorRun */
+		if (fired != NULL &&
+			fired->event.action == SIMULA_ACTION_THROTTLE_ROWS)
+			throttle = *fired;
+		else
+			fired = NULL;
+	}
+
+	if (prev_ExecutorStart)
+		(*prev_ExecutorStart) (queryDesc, eflags);
+	else
+		standard_ExecutorStart(queryDesc, eflags);
+
+	/* The plan tree is built now */
+	if (simulate && SimulaEventsHavePageReads)
+		wrapScanNodes(queryDesc->planstate, queryDesc->estate);
+
+	if (fired != NULL)
+		addRowThrottle(queryDesc->estate, &throttle);
+}
+
+/*
+ * Do the THROTTLE_ROWS event of the query, if any, for the rows processed.
+ * es_processed is reset at every ExecutorRun, e.g. FETCH of a cursor.
+ */
+static void
+pg_simula_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+					  uint64 count, bool execute_once)
+{
+	SimulaScan *throttle = NULL;
+	ListCell	*cell;
+
+	foreach(cell, SimulaScans)
+	{
+		SimulaScan *scan = lfirst(cell);
+
+		if (scan->planstate == NULL && scan->estate == queryDesc->estate)
+		{
+			throttle = scan;
+			break;
+		}
+	}
+
+	if (prev_ExecutorRun)
+		(*prev_ExecutorRun) (queryDesc, direction, count, execute_once);
+	else
+		standard_ExecutorRun(queryDesc, direction, count, execute_once);
+
+	if (throttle != NULL && simulation_enabled)
+		throttleEvent(&throttle->entry, queryDesc->estate->es_processed);
+}
+
+static void
+pg_simula_ExecutorEnd(QueryDesc *queryDesc)
+{
+	if (SimulaScans != NIL)
+		releaseScans(queryDesc->estate, InvalidSubTransactionId);
+
+	if (prev_ExecutorEnd)
+		(*prev_ExecutorEnd) (queryDesc);
+	else
+		standard_ExecutorEnd(queryDesc);
+}
+
+static void
+pg_simula_ProcessUtility(PlannedStmt *pstmt,
+						 const char *queryString,
+						 ProcessUtilityContext context,
+						 ParamListInfo params,
+						 QueryEnvironment *queryEnv,
+						 DestReceiver *dest,
+						 char *completionTag)
+{
+	Node	*parsetree = pstmt->utilityStmt;
+	const char *commandTag;
+
+	commandTag = CreateCommandTag(parsetree);
+
+	/* Register callback function if not yet */
+	registerCallbacks();
+
+	/*
+	 * Remember that the shared catalog needs to be updated at commit if the
+	 * extension itself or a database are created or dropped, or the table is
+	 * modified directly.
+	 */
+	if (simula_state != NULL)
+	{
+		if (isPgSimulaExtensionStmt(parsetree))
+			catalog_dirty = true;
+		else if (IsA(parsetree, DropdbStmt))
+			pending_drop_dbid =
+				get_database_oid(((DropdbStmt *) parsetree)->dbname, true);
+		else if (utilityModifiesEventTable(parsetree))
+			noteEventTableChange(SimulaTableRelid);
+	}
+
+	if (needReloadAndEvent(commandTag))
+	{
+		/* in_simulat_event_progress is turned off at end of the transaction */
+		in_simula_event_progress = true;
+		reloadEventTableData();
+		doEventIfAny(commandTag,
+					 SimulaEventsHaveRelations ?
+					 utilityTargetRelations(parsetree) : NIL, 0);
+		in_simula_event_progress = false;
+	}
+
+    /* Call the standard process utility chain. */
+    if (prev_ProcessUtility)
+        (*prev_ProcessUtility) (pstmt, queryString, context, params,
+                                     queryEnv, dest, completionTag);
+    else
+        standard_ProcessUtility(pstmt, queryString, context, params,
+                                queryEnv, dest, completionTag);
+}
+
+/*
+ * Reject or delay the new connection.
+ *
+ * The connection is refused if pg_simula.connection_refuse is on, it is one
+ * of pg_simula.connection_refuse_percent percent of new connections, or
+ * pg_simula.max_connections_per_sec is exceeded. The latter two are decided
+ * by the counters in shared memory so that all backends agree. The refusal
+ * is a copy function from auth_failed(auth.c).
+ */
+static void
+pg_simula_ClientAuthentication(Port *port, int status)
+{
+	const char *errstr;
+	int			errcode_return = ERRCODE_INVALID_AUTHORIZATION_SPECIFICATION;
+	bool		refuse;
+
+	if (prev_ClientAuthentication)
+		prev_ClientAuthentication(port, status);
+
+	/*
+	 * If we failed due to EOF from client, just quit; there's no point in
+	 * trying to send a message to the client, and not much point in logging
+	 * the failure in the postmaster log.  (Logging the failure might be
+	 * desirable, were it not for the fact that libpq closes the connection
+	 * unceremoniously if challenged for a password when it hasn't got one to
+	 * send.  We'll get a useless log entry for every psql connection under
+	 * password auth, even if it's perfectly successful, if we log STATUS_EOF
+	 * events.)
+	 */
+	if (connection_refused && status == STATUS_EOF)
+		proc_exit(0);
+
+	/* Connections being refused anyway don't count */
+	if (status != STATUS_OK)
+		refuse = connection_refused;
+	else
+		refuse = (connection_refused ||
+				  refuseConnectionByPercent() ||
+				  refuseConnectionByRate());
+
+	/* The client waits for the result of authentication either way */
+	if (auth_delay > 0 && status != STATUS_EOF)
+		simula_sleep((int64) auth_delay * 1000, SIMULA_WAIT_AUTH_DELAY, NULL);
+
+	if (!refuse)
+		return;
+
+	errstr = gettext_noop("authentication failed by pg_simula");
+
+	ereport(FATAL,
+			(errcode(errcode_return),
+			 errmsg(errstr, port->user_name), 0));
+	/* doesn't return */
+}
+
+/*
+ * Refuse exactly pg_simula.connection_refuse_percent percent of the
+ * connections, spread evenly: the n-th connection is refused if the number
+ * of refusals up to it, floor(n * percent / 100), is incremented by it.
+ */
+static bool
+refuseConnectionByPercent(void)
+{
+	uint64	n;
+
+	if (connection_refuse_percent <= 0 || simula_state == NULL)
+		return false;
+
+	n = pg_atomic_fetch_add_u64(&simula_state->conn_attempts, 1);
+
+	return (floor((double) (n + 1) * connection_refuse_percent / 100.0) >
+			floor((double) n * connection_refuse_percent / 100.0));
+}
+
+/*
+ * Refuse the connections exceeding pg_simula.max_connections_per_sec. Like
+ * throttleEvent(), this is GCRA on the shared conn_tat, except that the
+ * connection is refused instead of waiting, and that a burst of up to one
+ * second worth of connections is allowed.
+ */
+static bool
+refuseConnectionByRate(void)
+{
+	uint64	interval;
+	uint64	now;
+	uint64	start;
+	uint64	old;
+
+	if (max_connections_per_sec <= 0 || simula_state == NULL)
+		return false;
+
+	interval = (uint64) (1000000000.0 / max_connections_per_sec);
+	now = monotonic_nsec();
+
+	old = pg_atomic_read_u64(&simula_state->conn_tat);
+	do
+	{
+		start = Max(old, now);
+
+		if (start + interval > now + 1000000000)
+			return true;
+		/* On failure, old is updated to the current value */
+	} while (!pg_atomic_compare_exchange_u64(&simula_state->conn_tat, &old,
+											 start + interval));
+
+	return false;
+}
+
+/*
+ * Do the action of the event for the given command, if any. An event
+ * targeting the query identifier of the statement takes precedence over an
+ * event targeting one of the given relations, which takes precedence over
+ * the event for all relations. Return the event if its action was done.
+ */
+static SimulaEventEntry *
+doEventIfAny(const char *commandTag, List *relids, int64 queryid)
+{
+	SimulaEventEntry *entry = NULL;
+	ListCell	*cell;
+
+	if (queryid != 0 && hash_get_num_entries(SimulaQueryEvents) > 0)
+	{
+		SimulaQueryEntry *qentry;
+
+		qentry = hash_search(SimulaQueryEvents, &queryid, HASH_FIND, NULL);
+		for (entry = qentry ? qentry->events : NULL; entry != NULL;
+			 entry = entry->next_query)
+		{
+			if (strcmp(entry->key.operation, commandTag) == 0)
+				break;
+		}
+	}
+
+	foreach(cell, relids)
+	{
+		if (entry != NULL)
+			break;
+		entry = lookupEvent(commandTag, lfirst_oid(cell));
+	}
+
+	if (entry == NULL)
+		entry = lookupEvent(commandTag, InvalidOid);
+
+	if (entry == NULL)
+		return NULL;
+
+	/* Might be left by a PAGE READ event interrupted */
+	SimulaPageRelid = InvalidOid;
+
+	return fireEvent(entry) ? entry : NULL;
+}
+
+/*
+ * Look up the event for the given pseudo operation done at commit. Only
+ * transactions having an XID write the commit record. We don't reload the
+ * catalog here, so the events are as of the last statement.
+ */
+static SimulaEventEntry *
+lookupCommitEvent(const char *operation)
+{
+	if (!simulation_enabled || simula_state == NULL ||
+		in_simula_event_progress || !SimulaEventsValid ||
+		hash_get_num_entries(SimulaEvents) == 0)
+		return NULL;
+
+	if (!TransactionIdIsValid(GetTopTransactionIdIfAny()))
+		return NULL;
+
+	checkEventFilters();
+
+	return lookupEvent(operation, InvalidOid);
+}
+
+/*
+ * Do the WAL FLUSH event for the commit of the current transaction.
+ *
+ * Like XLogFlush(), the backend that gets the lock does the action on behalf
+ * of all the commits requested so far, and the backends that waited for the
+ * lock meanwhile see that their commits are covered. So the group commit
+ * behaves as it does on a slow disk.
+ */
+static void
+doWalFlushEvent(SimulaEventEntry *entry)
+{
+	uint64	request;
+
+	request = pg_atomic_add_fetch_u64(&simula_state->wal_requested, 1);
+
+	for (;;)
+	{
+		if (pg_atomic_read_u64(&simula_state->wal_flushed) >= request)
+		{
+			/* flushed by someone else */
+			eventStats(entry)->matches++;
+			return;
+		}
+
+		if (LWLockAcquireOrWait(simula_state->wal_lock, LW_EXCLUSIVE))
+			break;
+	}
+
+	if (pg_atomic_read_u64(&simula_state->wal_flushed) >= request)
+		eventStats(entry)->matches++;
+	else
+	{
+		/* Flush all the requests so far */
+		request = pg_atomic_read_u64(&simula_state->wal_requested);
+		fireEvent(entry);
+		pg_atomic_write_u64(&simula_state->wal_flushed, request);
+	}
+
+	LWLockRelease(simula_state->wal_lock);
+}
+
+/*
+ * Do the action of the given event with its probability. Return true if
+ * the action was done.
+ *
+ * If the event has skip or times, the occurrences are numbered by the
+ * shared counter so that all backends follow the same sequence. Once the
+ * skipped occurrences or the whole sequence are over we only read the
+ * counter, which doesn't bounce the cache line between backends.
+ */
+static bool
+fireEvent(SimulaEventEntry *entry)
+{
+	SimulaLocalStats *stats;
+	SimulaEvent *event = &(entry->event);
+
+	if (!entry->applies)
+		return false;
+
+	/* Just a comparison of the clock until the window changes */
+	if (entry->scheduled)
+	{
+		TimestampTz now = GetCurrentTimestamp();
+
+		if (now >= entry->toggle_at)
+			updateEventWindow(entry, now);
+		if (!entry->in_window)
+			return false;
+	}
+
+	stats = eventStats(entry);
+	stats->matches++;
+
+	if (event->skip > 0 || event->times > 0)
+	{
+		pg_atomic_uint64 *occurrences =
+			&(simula_state->slots[entry->slot].occurrences);
+		uint64	end = (uint64) (event->skip + event->times);
+		uint64	n = pg_atomic_read_u64(occurrences);
+
+		if (event->times > 0 && n >= end)
+			return false;
+
+		/* Without times, all occurrences after the skipped ones fire */
+		if (event->times > 0 || n < (uint64) event->skip)
+		{
+			n = pg_atomic_fetch_add_u64(occurrences, 1);
+			if (n < (uint64) event->skip || (event->times > 0 && n >= end))
+				return false;
+		}
+	}
+
+	/* Fire only with the given probability */
+	if (event->probability < 1.0 &&
+		simula_random_double() >= event->probability)
+		return false;
+
+	stats->fires++;
+	entry->func(entry);
+
+	return true;
+}
+
+/*
+ * Compute whether the event is in its time window at now, and when that
+ * changes next. The active part of a period begins at every period
+ * microseconds since start_at, or since the epoch if start_at is not given.
+ */
+static void
+updateEventWindow(SimulaEventEntry *entry, TimestampTz now)
+{
+	SimulaEvent *event = &(entry->event);
+
+	if (now < event->start_at)
+	{
+		entry->in_window = false;
+		entry->toggle_at = event->start_at;
+	}
+	else if (now >= event->stop_at)
+	{
+		entry->in_window = false;
+		entry->toggle_at = DT_NOEND;
+	}
+	else if (event->period <= 0)
+	{
+		entry->in_window = true;
+		entry->toggle_at = event->stop_at;
+	}
+	else
+	{
+		TimestampTz base = (event->start_at == DT_NOBEGIN) ? 0 : event->start_at;
+		int64	phase = (now - base) % event->period;
+		TimestampTz cycle;
+
+		if (phase < 0)
+			phase += event->period;
+		cycle = now - phase;
+
+		entry->in_window = (phase < event->active);
+		entry->toggle_at = cycle + (entry->in_window ? event->active :
+									event->period);
+		entry->toggle_at = Min(entry->toggle_at, event->stop_at);
+	}
+}
+
+/*
+ * Look up the event for the given command and relation. Since command tags
+ * are always upper-cased, we don't need to normalize it.
+ */
+static SimulaEventEntry *
+lookupEvent(const char *commandTag, Oid relid)
+{
+	SimulaEventKey key;
+
+	memset(&key, 0, sizeof(key));
+	strlcpy(key.operation, commandTag, NAMEDATALEN);
+	key.relid = relid;
+
+	return hash_search(SimulaEvents, &key, HASH_FIND, NULL);
+}
+
+/*
+ * Recompute applies of SimulaEvents if the role or application_name of the
+ * session has changed since the last time, which is rare. We don't need to
+ * check anything unless any event has the filters.
+ */
+static void
+checkEventFilters(void)
+{
+	HASH_SEQ_STATUS	status;
+	SimulaEventEntry *entry;
+	const char *appname = application_name ? application_name : "";
+
+	if (!SimulaEventsHaveFilters ||
+		(FilterUserId == GetUserId() &&
+		 strncmp(FilterAppName, appname, NAMEDATALEN) == 0))
+		return;
+
+	FilterUserId = GetUserId();
+	strlcpy(FilterAppName, appname, NAMEDATALEN);
+
+	hash_seq_init(&status, SimulaEvents);
+	while ((entry = (SimulaEventEntry *) hash_seq_search(&status)) != NULL)
+		entry->applies = eventApplies(&(entry->event));
+}
+
+/*
+ * Return true if the event applies to the role and application_name given
+ * by FilterUserId and FilterAppName.
+ */
+static bool
+eventApplies(const SimulaEvent *event)
+{
+	if (OidIsValid(event->roleid) && event->roleid != FilterUserId)
+		return false;
+
+	if (event->appname[0] != '\0' && strcmp(event->appname, FilterAppName) != 0)
+		return false;
+
+	return true;
+}
+
+/*
+ * Return the list of relation OIDs targeted by the given statement: the
+ * result relations of INSERT, UPDATE and DELETE with the partitioned root
+ * first, or all relations of SELECT.
+ */
+static List *
+plannedStmtTargetRelations(PlannedStmt *pstmt)
+{
+	List	*relids = NIL;
+	ListCell	*cell;
+
+	foreach(cell, pstmt->rootResultRelations)
+		relids = lappend_oid(relids,
+							 rt_fetch(lfirst_int(cell), pstmt->rtable)->relid);
+	foreach(cell, pstmt->resultRelations)
+		relids = lappend_oid(relids,
+							 rt_fetch(lfirst_int(cell), pstmt->rtable)->relid);
+
+	if (relids != NIL)
+		return relids;
+
+	foreach(cell, pstmt->rtable)
+	{
+		RangeTblEntry *rte = lfirst(cell);
+
+		if (rte->rtekind == RTE_RELATION)
+			relids = lappend_oid(relids, rte->relid);
+	}
+
+	return relids;
+}
+
+/* Return the list of relation OIDs targeted by the given utility command */
+static List *
+utilityTargetRelations(Node *parsetree)
+{
+	List	*rangevars = NIL;
+	List	*relids = NIL;
+	ListCell	*cell;
+
+	switch (nodeTag(parsetree))
+	{
+		case T_TruncateStmt:
+			rangevars = ((TruncateStmt *) parsetree)->relations;
+			break;
+		case T_LockStmt:
+			rangevars = ((LockStmt *) parsetree)->relations;
+			break;
+		case T_VacuumStmt:
+			rangevars = list_make1(((VacuumStmt *) parsetree)->relation);
+			break;
+		case T_ClusterStmt:
+			rangevars = list_make1(((ClusterStmt *) parsetree)->relation);
+			break;
+		case T_CopyStmt:
+			rangevars = list_make1(((CopyStmt *) parsetree)->relation);
+			break;
+		case T_IndexStmt:
+			rangevars = list_make1(((IndexStmt *) parsetree)->relation);
+			break;
+		case T_ReindexStmt:
+			rangevars = list_make1(((ReindexStmt *) parsetree)->relation);
+			break;
+		case T_AlterTableStmt:
+			rangevars = list_make1(((AlterTableStmt *) parsetree)->relation);
+			break;
+		case T_CreateTrigStmt:
+			rangevars = list_make1(((CreateTrigStmt *) parsetree)->relation);
+			break;
+		default:
+			break;
+	}
+
+	foreach(cell, rangevars)
+	{
+		RangeVar *rv = lfirst(cell);
+		Oid		relid;
+
+		/* e.g. database-wide VACUUM or COPY from a query */
+		if (rv == NULL)
+			continue;
+
+		relid = RangeVarGetRelid(rv, NoLock, true);
+		if (OidIsValid(relid))
+			relids = lappend_oid(relids, relid);
+	}
+
+	return relids;
+}
+
+/* Return the index of DistributionNames for the given name, or -1 */
+static int
+lookupDistribution(const char *distribution)
+{
+	int		i;
+
+	for (i = 0; DistributionNames[i] != NULL; i++)
+	{
+		if (pg_strcasecmp(DistributionNames[i], distribution) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Return the length of the given interval in microseconds */
+static int64
+intervalToUsec(Interval *span)
+{
+	return span->time +
+		(span->day + (int64) span->month * DAYS_PER_MONTH) * USECS_PER_DAY;
+}
+
+/* Return the index of ActionTable for the given action name, or -1 */
+static int
+lookupAction(const char *action)
+{
+	int		i;
+
+	for (i = 0; ActionTable[i].action != NULL; i++)
+	{
+		if (pg_strcasecmp(ActionTable[i].action, action) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Parse the lock_target of HOLD_LOCK action: "advisory:<key>", "lwlock:<n>"
+ * or a relation, which is given by name or OID. Relation names are looked up
+ * only if lookup_names is true. Return the description of the problem if
+ * invalid, otherwise NULL. This must not raise an error since it's used
+ * when loading the table.
+ */
+static const char *
+parseLockTarget(SimulaEvent *event, const char *target, bool lookup_names)
+{
+	char   *end;
+	int64	key;
+
+	if (target[0] == '\0')
+	{
+		event->lock_type = SIMULA_LOCK_NONE;
+		event->lock_key = 0;
+		return NULL;
+	}
+
+	if (pg_strncasecmp(target, "advisory:", 9) == 0)
+	{
+		errno = 0;
+		key = strtoll(target + 9, &end, 10);
+		if (errno != 0 || end == target + 9 || *end != '\0')
+			return "invalid advisory lock key";
+
+		event->lock_type = SIMULA_LOCK_ADVISORY;
+		event->lock_key = key;
+		return NULL;
+	}
+
+	if (pg_strncasecmp(target, "lwlock:", 7) == 0)
+	{
+		errno = 0;
+		key = strtoll(target + 7, &end, 10);
+		if (errno != 0 || end == target + 7 || *end != '\0' ||
+			key < 0 || key >= SIMULA_NUM_HOLD_LWLOCKS)
+			return "LWLock number must be between 0 and 15";
+
+		event->lock_type = SIMULA_LOCK_LWLOCK;
+		event->lock_key = key;
+		return NULL;
+	}
+
+	/* A relation given by OID */
+	errno = 0;
+	key = strtoll(target, &end, 10);
+	if (errno == 0 && end != target && *end == '\0')
+	{
+		if (key <= 0 || key > PG_UINT32_MAX)
+			return "invalid relation OID of lock target";
+	}
+	else if (lookup_names)
+	{
+		char   *rawname = pstrdup(target);
+		List   *names;
+		RangeVar *rv;
+		Oid		relid;
+
+		if (!SplitIdentifierString(rawname, '.', &names) ||
+			list_length(names) > 2)
+			return "invalid relation name of lock target";
+
+		if (list_length(names) == 2)
+			rv = makeRangeVar(linitial(names), lsecond(names), -1);
+		else
+			rv = makeRangeVar(NULL, linitial(names), -1);
+
+		relid = RangeVarGetRelid(rv, NoLock, true);
+		if (!OidIsValid(relid))
+			return "lock target relation does not exist";
+		key = (int64) relid;
+	}
+	else
+		return "lock target relation must be given by OID";
+
+	event->lock_type = SIMULA_LOCK_RELATION;
+	event->lock_key = key;
+	return NULL;
+}
+
+/* Parse the lock_mode of HOLD_LOCK action, such as "ExclusiveLock" */
+static const char *
+parseLockMode(SimulaEvent *event, const char *mode)
+{
+	int		i;
+
+	for (i = AccessShareLock; i <= AccessExclusiveLock; i++)
+	{
+		if (pg_strcasecmp(mode, LockModeNames[i]) == 0)
+		{
+			event->lock_mode = (LOCKMODE) i;
+			return NULL;
+		}
+	}
+
+	return "invalid lock mode";
+}
+
+/*
+ * Wrap the scan nodes reading a heap relation that has the PAGE READ event,
+ * so that the event is done whenever the scan moves to another heap page.
+ */
+static bool
+wrapScanNodes(PlanState *planstate, EState *estate)
+{
+	SimulaEventEntry *entry;
+	SimulaScan *scan;
+	SimulaScanNode *node;
+	MemoryContext oldcxt;
+	Relation	rel;
+
+	if (planstate == NULL)
+		return false;
+
+	switch (nodeTag(planstate))
+	{
+		case T_SeqScanState:
+		case T_IndexScanState:
+		case T_IndexOnlyScanState:
+		case T_BitmapHeapScanState:
+			rel = ((ScanState *) planstate)->ss_currentRelation;
+			break;
+		default:
+			rel = NULL;
+			break;
+	}
+
+	if (rel != NULL &&
+		((entry = lookupEvent(SIMULA_OP_PAGE_READ,
+							  RelationGetRelid(rel))) != NULL ||
+		 (entry = lookupEvent(SIMULA_OP_PAGE_READ, InvalidOid)) != NULL))
+	{
+		if (SimulaScanNodes == NULL)
+		{
+			HASHCTL		ctl;
+
+			memset(&ctl, 0, sizeof(ctl));
+			ctl.keysize = sizeof(PlanState *);
+			ctl.entrysize = sizeof(SimulaScanNode);
+			SimulaScanNodes = hash_create("pg_simula scan nodes", 16, &ctl,
+										  HASH_ELEM | HASH_BLOBS);
+		}
+
+		/*
+		 * The nodes of the queries that have ended or been aborted are
+		 * released, so the node is not wrapped yet.
+		 */
+		oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+		scan = palloc0(sizeof(SimulaScan));
+		SimulaScans = lappend(SimulaScans, scan);
+		MemoryContextSwitchTo(oldcxt);
+
+		node = hash_search(SimulaScanNodes, &planstate, HASH_ENTER, NULL);
+		node->scan = scan;
+
+		scan->planstate = planstate;
+		scan->orig_ExecProcNode = planstate->ExecProcNodeReal;
+		scan->estate = estate;
+		scan->subid = GetCurrentSubTransactionId();
+		scan->lastblock = InvalidBlockNumber;
+		scan->entry = *entry;
+		scan->entry.dirty = false;
+		memset(&scan->entry.stats, 0, sizeof(SimulaLocalStats));
+
+		ExecSetExecProcNode(planstate, pg_simula_ExecScan);
+	}
+
+	return planstate_tree_walker(planstate, wrapScanNodes, estate);
+}
+
+/* Remember the THROTTLE_ROWS event for the rows the query processes */
+static void
+addRowThrottle(EState *estate, SimulaEventEntry *entry)
+{
+	MemoryContext oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+	SimulaScan *scan = palloc0(sizeof(SimulaScan));
+
+	scan->estate = estate;
+	scan->subid = GetCurrentSubTransactionId();
+	scan->lastblock = InvalidBlockNumber;
+	scan->entry = *entry;
+	scan->entry.dirty = false;
+	memset(&scan->entry.stats, 0, sizeof(SimulaLocalStats));
+	SimulaScans = lappend(SimulaScans, scan);
+
+	MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * Forget the events of queries of the given executor state, or of the given
+ * subtransaction if estate is NULL, or all of them if both are not given.
+ */
+static void
+releaseScans(EState *estate, SubTransactionId subid)
+{
+	ListCell	*cell;
+	ListCell	*prev = NULL;
+	ListCell	*next;
+	bool		flushed = false;
+
+	for (cell = list_head(SimulaScans); cell != NULL; cell = next)
+	{
+		SimulaScan *scan = lfirst(cell);
+
+		next = lnext(cell);
+
+		if ((estate != NULL && scan->estate != estate) ||
+			(subid != InvalidSubTransactionId && scan->subid != subid))
+		{
+			prev = cell;
+			continue;
+		}
+
+		/* DirtyEntries might refer to the entry being freed */
+		if (scan->entry.dirty && !flushed)
+		{
+			flushEventStats();
+			flushed = true;
+		}
+
+		if (scan->planstate != NULL)
+			hash_search(SimulaScanNodes, &scan->planstate, HASH_REMOVE, NULL);
+		if (scan == SimulaLastScan)
+			SimulaLastScan = NULL;
+		SimulaScans = list_delete_cell(SimulaScans, cell, prev);
+		pfree(scan);
+	}
+}
+
+/*
+ * ExecProcNode of the wrapped scan nodes. Do the PAGE READ event when the
+ * tuple returned is on another heap page than the last one.
+ */
+static TupleTableSlot *
+pg_simula_ExecScan(PlanState *pstate)
+{
+	SimulaScanNode *node;
+	SimulaScan *scan;
+	TupleTableSlot *slot;
+	BlockNumber	blkno;
+
+	/* Look up the node only when another one is executed */
+	scan = SimulaLastScan;
+	if (scan == NULL || scan->planstate != pstate)
+	{
+		node = hash_search(SimulaScanNodes, &pstate, HASH_FIND, NULL);
+		if (node == NULL)
+			elog(ERROR, "pg_simula could not find scan node %p", pstate);
+		scan = SimulaLastScan = node->scan;
+	}
+
+	slot = scan->orig_ExecProcNode(pstate);
+
+	blkno = currentScanBlock(pstate);
+	if (blkno != InvalidBlockNumber && blkno != scan->lastblock)
+	{
+		SimulaEvent *event = &(scan->entry.event);
+
+		scan->lastblock = blkno;
+
+		/* Pages out of the range pay only the comparison */
+		if (simulation_enabled &&
+			(int64) blkno >= event->first_block &&
+			(event->last_block < 0 || (int64) blkno <= event->last_block))
+		{
+			SimulaPageRelid = RelationGetRelid(((ScanState *) pstate)->ss_currentRelation);
+			SimulaPageBlock = blkno;
+			fireEvent(&scan->entry);
+			SimulaPageRelid = InvalidOid;
+		}
+	}
+
+	return slot;
+}
+
+/* Return the heap block the scan node is on, or InvalidBlockNumber */
+static BlockNumber
+currentScanBlock(PlanState *pstate)
+{
+	IndexScanDesc iscan = NULL;
+	Buffer		buf = InvalidBuffer;
+
+	switch (nodeTag(pstate))
+	{
+		case T_SeqScanState:
+		case T_BitmapHeapScanState:
+			{
+				HeapScanDesc hscan = ((ScanState *) pstate)->ss_currentScanDesc;
+
+				if (hscan != NULL)
+					buf = hscan->rs_cbuf;
+				break;
+			}
+		case T_IndexScanState:
+			iscan = ((IndexScanState *) pstate)->iss_ScanDesc;
+			break;
+		case T_IndexOnlyScanState:
+			/* the heap is not visited for all-visible pages */
+			iscan = ((IndexOnlyScanState *) pstate)->ioss_ScanDesc;
+			break;
+		default:
+			break;
+	}
+
+	if (iscan != NULL)
+		buf = iscan->xs_cbuf;
+
+	if (!BufferIsValid(buf))
+		return InvalidBlockNumber;
+
+	return BufferGetBlockNumber(buf);
+}
+
+static void
+error_func(SimulaEventEntry *entry)
+{
+	eventStats(entry)->errors++;
+
+	/* Look like a failure of read(2) in case of PAGE READ event */
+	if (OidIsValid(SimulaPageRelid))
+	{
+		Oid		relid = SimulaPageRelid;
+
+		SimulaPageRelid = InvalidOid;
+		ereport(ERROR,
+				(errcode(ERRCODE_IO_ERROR),
+				 errmsg("simulation of I/O error by pg_simula"),
+				 errdetail("could not read block %u of relation %s",
+						   SimulaPageBlock, get_rel_name(relid))));
+	}
+
+	ereport(ERROR, (errmsg("simulation of ERROR by pg_simula")));
+}
+
+static void
+panic_func(SimulaEventEntry *entry)
+{
+	eventStats(entry)->errors++;
+	ereport(PANIC, (errmsg("simulation of PANIC by pg_simula")));
+}
+
+static void
+wait_func(SimulaEventEntry *entry)
+{
+	const char *operation = entry->event.operation;
+	uint32	wait_event_info = SIMULA_WAIT_STATEMENT;
+	int64	delay;
+	SimulaLocalStats *stats;
+
+	if (strcmp(operation, SIMULA_OP_PAGE_READ) == 0)
+		wait_event_info = SIMULA_WAIT_PAGE_READ;
+	else if (strcmp(operation, SIMULA_OP_WAL_FLUSH) == 0)
+		wait_event_info = SIMULA_WAIT_WAL_FLUSH;
+	else if (strcmp(operation, SIMULA_OP_SYNCREP_WAIT) == 0)
+		wait_event_info = SIMULA_WAIT_SYNCREP;
+	else if (strcmp(operation, SIMULA_OP_PARALLEL_WORKER) == 0)
+		wait_event_info = SIMULA_WAIT_PARALLEL_WORKER;
+
+	delay = simula_sleep(sampleWaitTime(&(entry->event)), wait_event_info,
+						 "WAIT");
+
+	stats = eventStats(entry);
+	stats->total_delay += (uint64) delay;
+	stats->max_delay = Max(stats->max_delay, (uint64) delay);
+}
+
+static void
+fatal_func(SimulaEventEntry *entry)
+{
+	eventStats(entry)->errors++;
 	ereport(FATAL, (errmsg("simulation of FATAL by pg_simula")));
 }
+
+static void
+throttle_func(SimulaEventEntry *entry)
+{
+	throttleEvent(entry, 1);
+}
+
+/* The rows are throttled at the end of ExecutorRun, see there */
+static void
+throttle_rows_func(SimulaEventEntry *entry)
+{
+}
+
+/*
+ * Keep the CPU busy for the wait time, checking for interrupts. The clock
+ * is read only after each chunk of the busy loop calibrated to take about
+ * BURN_CHUNK_USEC, so that the loop rather than the clock uses the CPU.
+ * With pg_simula.burn_pin, the backend stays on the CPU it is running on,
+ * so that the burning backends contend for the run queue of the CPU.
+ */
+static void
+burn_func(SimulaEventEntry *entry)
+{
+	int64		usec = sampleWaitTime(&(entry->event));
+	instr_time	start;
+	instr_time	now;
+	int64		elapsed;
+	SimulaLocalStats *stats;
+#ifdef __linux__
+	cpu_set_t	saved_mask;
+	bool		pinned = false;
+
+	if (burn_pin)
+	{
+		cpu_set_t	mask;
+		int			cpu = sched_getcpu();
+
+		if (cpu >= 0 &&
+			sched_getaffinity(0, sizeof(saved_mask), &saved_mask) == 0)
+		{
+			CPU_ZERO(&mask);
+			CPU_SET(cpu, &mask);
+			pinned = (sched_setaffinity(0, sizeof(mask), &mask) == 0);
+		}
+
+		if (!pinned)
+			elog(DEBUG1, "could not pin pg_simula BURN to CPU %d: %m", cpu);
+	}
+#endif
+
+	if (burn_chunk_loops == 0)
+		calibrateBurnLoops();
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	PG_TRY();
+	{
+		for (;;)
+		{
+			CHECK_FOR_INTERRUPTS();
+
+			INSTR_TIME_SET_CURRENT(now);
+			INSTR_TIME_SUBTRACT(now, start);
+			elapsed = (int64) INSTR_TIME_GET_MICROSEC(now);
+
+			if (elapsed >= usec)
+				break;
+
+			burnLoops(burn_chunk_loops);
+		}
+	}
+	PG_CATCH();
+	{
+#ifdef __linux__
+		if (pinned)
+			sched_setaffinity(0, sizeof(saved_mask), &saved_mask);
+#endif
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+#ifdef __linux__
+	if (pinned)
+		sched_setaffinity(0, sizeof(saved_mask), &saved_mask);
+#endif
+
+	stats = eventStats(entry);
+	stats->total_delay += (uint64) elapsed;
+	stats->max_delay = Max(stats->max_delay, (uint64) elapsed);
+}
+
+/*
+ * Allocate size_mb megabytes and hold them until end of transaction. The
+ * memory is allocated in SimulaMemoryContext so that it appears in the
+ * memory context statistics of the backend, and every page is written so
+ * that it is actually resident rather than just reserved.
+ */
+static void
+memory_func(SimulaEventEntry *entry)
+{
+	Size	chunk_size = (Size) 1024 * 1024;
+	int		i;
+
+	if (SimulaMemoryContext == NULL)
+		SimulaMemoryContext = AllocSetContextCreate(TopMemoryContext,
+													"pg_simula memory pressure",
+													ALLOCSET_DEFAULT_SIZES);
+
+	for (i = 0; i < entry->event.size_mb; i++)
+	{
+		char   *chunk = MemoryContextAlloc(SimulaMemoryContext, chunk_size);
+		Size	off;
+
+		for (off = 0; off < chunk_size; off += SIMULA_PAGE_SIZE)
+			chunk[off] = (char) i;
+
+		if ((i & 63) == 63)
+			CHECK_FOR_INTERRUPTS();
+	}
+}
+
+/*
+ * Take the lock of the event and hold it for the wait time before the
+ * statement runs. The lock is taken like a statement would, so the
+ * backends queue for it, lock_timeout applies and the deadlock detector
+ * runs for heavyweight locks. Waiting for or holding an LWLock cannot be
+ * canceled, just like the LWLocks of the server. The held time is counted
+ * as the delay.
+ */
+static void
+hold_lock_func(SimulaEventEntry *entry)
+{
+	SimulaEvent *event = &(entry->event);
+	int64	usec = sampleWaitTime(event);
+	int64	delay;
+	LOCKTAG	tag;
+	LWLock *lwlock = NULL;
+	SimulaLocalStats *stats;
+
+	switch (event->lock_type)
+	{
+		case SIMULA_LOCK_RELATION:
+			LockRelationOid((Oid) event->lock_key, event->lock_mode);
+			break;
+
+		case SIMULA_LOCK_ADVISORY:
+			/* Same as pg_advisory_xact_lock(bigint) */
+			SET_LOCKTAG_ADVISORY(tag, MyDatabaseId,
+								 (uint32) (event->lock_key >> 32),
+								 (uint32) event->lock_key, 1);
+			(void) LockAcquire(&tag, event->lock_mode, false, false);
+			break;
+
+		case SIMULA_LOCK_LWLOCK:
+			lwlock = &(simula_state->hold_locks[event->lock_key].lock);
+			LWLockAcquire(lwlock, event->lock_mode == ShareLock ?
+						  LW_SHARED : LW_EXCLUSIVE);
+			break;
+
+		default:
+			return;
+	}
+
+	/* Locks are released by abort if interrupted */
+	delay = simula_sleep(usec, SIMULA_WAIT_HOLD_LOCK, "HOLD_LOCK");
+
+	switch (event->lock_type)
+	{
+		case SIMULA_LOCK_RELATION:
+			UnlockRelationOid((Oid) event->lock_key, event->lock_mode);
+			break;
+
+		case SIMULA_LOCK_ADVISORY:
+			LockRelease(&tag, event->lock_mode, false);
+			break;
+
+		case SIMULA_LOCK_LWLOCK:
+			LWLockRelease(lwlock);
+			break;
+
+		default:
+			break;
+	}
+
+	stats = eventStats(entry);
+	stats->total_delay += (uint64) delay;
+	stats->max_delay = Max(stats->max_delay, (uint64) delay);
+}
+
+/* Spin for the given number of iterations of a dependent computation */
+static void
+burnLoops(uint64 nloops)
+{
+	uint64	x = burn_sink;
+	uint64	i;
+
+	for (i = 0; i < nloops; i++)
+		x = x * UINT64CONST(6364136223846793005) + UINT64CONST(1442695040888963407);
+
+	/* Keep the compiler from removing the loop */
+	burn_sink = x;
+}
+
+/* Compute the number of iterations of burnLoops() in BURN_CHUNK_USEC */
+static void
+calibrateBurnLoops(void)
+{
+	uint64		nloops = 1 << 16;
+	instr_time	start;
+	instr_time	duration;
+	double		usec;
+
+	INSTR_TIME_SET_CURRENT(start);
+	burnLoops(nloops);
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	usec = INSTR_TIME_GET_DOUBLE(duration) * 1000000.0;
+	if (usec > 0)
+		burn_chunk_loops = (uint64) Max(nloops * BURN_CHUNK_USEC / usec, 1);
+	else
+		burn_chunk_loops = nloops;
+}
+
+/*
+ * Return the local statistics of the event to update. The entry is
+ * remembered so that they are flushed later.
+ */
+static SimulaLocalStats *
+eventStats(SimulaEventEntry *entry)
+{
+	if (!entry->dirty)
+	{
+		if (NumDirtyEntries >= MAX_DIRTY_ENTRIES)
+			flushEventStats();
+
+		DirtyEntries[NumDirtyEntries++] = entry;
+		entry->dirty = true;
+	}
+
+	return &(entry->stats);
+}
+
+/*
+ * Add the local statistics to the shared catalog.
+ *
+ * If the catalog has been changed since we copied it, the slot might have
+ * been reused for another event. In that case we check that the slot still
+ * has our event. The shared lock keeps the slots from being reused while we
+ * add to them.
+ */
+static void
+flushEventStats(void)
+{
+	bool	stale;
+	int		i;
+
+	if (NumDirtyEntries == 0)
+		return;
+
+	LWLockAcquire(simula_state->lock, LW_SHARED);
+	stale = (SimulaEventsGeneration !=
+			 pg_atomic_read_u64(&simula_state->generation));
+
+	for (i = 0; i < NumDirtyEntries; i++)
+	{
+		SimulaEventEntry *entry = DirtyEntries[i];
+		SimulaSlot *slot = &(simula_state->slots[entry->slot]);
+		SimulaLocalStats *local = &(entry->stats);
+
+		if (!stale ||
+			(slot->in_use && sameEventKey(&(slot->event), &(entry->event))))
+		{
+			if (local->matches > 0)
+				pg_atomic_fetch_add_u64(&slot->stats.matches, local->matches);
+			if (local->fires > 0)
+				pg_atomic_fetch_add_u64(&slot->stats.fires, local->fires);
+			if (local->errors > 0)
+				pg_atomic_fetch_add_u64(&slot->stats.errors, local->errors);
+			if (local->total_delay > 0)
+				pg_atomic_fetch_add_u64(&slot->stats.total_delay,
+										local->total_delay);
+			atomic_max_u64(&slot->stats.max_delay, local->max_delay);
+		}
+
+		memset(local, 0, sizeof(SimulaLocalStats));
+		entry->dirty = false;
+	}
+
+	LWLockRelease(simula_state->lock);
+
+	NumDirtyEntries = 0;
+}
+
+/* Atomically set *ptr to value if it's larger than the current value */
+static void
+atomic_max_u64(pg_atomic_uint64 *ptr, uint64 value)
+{
+	uint64	cur = pg_atomic_read_u64(ptr);
+
+	while (cur < value)
+	{
+		/* On failure, cur is updated to the current value */
+		if (pg_atomic_compare_exchange_u64(ptr, &cur, value))
+			break;
+	}
+}
+
+/*
+ * Take the given number of tokens from the bucket of the event shared by
+ * all backends, sleeping until they are available.
+ *
+ * This is GCRA: throttle_tat is the time when the bucket gets the next
+ * token, advanced by ntokens / rate seconds for each request. Since the
+ * request reserves the tokens ahead by a compare-and-swap, we just sleep
+ * until the reserved time without any lock. The bucket doesn't keep the
+ * tokens not taken while idle, so no burst is allowed.
+ */
+static void
+throttleEvent(SimulaEventEntry *entry, uint64 ntokens)
+{
+	pg_atomic_uint64 *tat = &(simula_state->slots[entry->slot].throttle_tat);
+	uint64	cost;
+	uint64	now;
+	uint64	start;
+	uint64	old;
+	int64	delay;
+	SimulaLocalStats *stats;
+
+	if (ntokens == 0)
+		return;
+
+	cost = (uint64) ((double) ntokens * 1000000000.0 / entry->event.rate);
+	now = monotonic_nsec();
+
+	old = pg_atomic_read_u64(tat);
+	do
+	{
+		start = Max(old, now);
+		/* On failure, old is updated to the current value */
+	} while (!pg_atomic_compare_exchange_u64(tat, &old, start + cost));
+
+	if (start <= now)
+		return;
+
+	delay = simula_sleep((int64) ((start - now) / 1000), SIMULA_WAIT_THROTTLE,
+						 "THROTTLE");
+
+	stats = eventStats(entry);
+	stats->total_delay += (uint64) delay;
+	stats->max_delay = Max(stats->max_delay, (uint64) delay);
+}
+
+/* Return the time of the monotonic clock in nanoseconds */
+static uint64
+monotonic_nsec(void)
+{
+	instr_time	now;
+
+	INSTR_TIME_SET_CURRENT(now);
+
+	return (uint64) (INSTR_TIME_GET_DOUBLE(now) * 1000000000.0);
+}
+
+/*
+ * Sleep for the given microseconds, and return the time actually slept.
+ *
+ * We wait on our latch so that query cancel and termination can interrupt
+ * the sleep. Since WaitLatch takes the timeout in milliseconds, the rest
+ * shorter than a millisecond is slept by pg_usleep. The given wait event is
+ * reported for the whole sleep, and if activity is given, the process title
+ * shows it appended like " waiting" of lock waits.
+ */
+static int64
+simula_sleep(int64 usec, uint32 wait_event_info, const char *activity)
+{
+	instr_time	start;
+	instr_time	now;
+	char	   *new_status = NULL;
+	int64		slept;
+
+	if (activity != NULL && update_process_title)
+	{
+		const char *old_status;
+		int		len;
+		int		extra = strlen(" pg_simula ") + strlen(activity);
+
+		old_status = get_ps_display(&len);
+		new_status = (char *) palloc(len + extra + 1);
+		memcpy(new_status, old_status, len);
+		sprintf(new_status + len, " pg_simula %s", activity);
+		set_ps_display(new_status, false);
+		new_status[len] = '\0';	/* truncate off " pg_simula ..." */
+	}
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	for (;;)
+	{
+		int64	remain;
+		int		rc;
+
+		CHECK_FOR_INTERRUPTS();
+
+		INSTR_TIME_SET_CURRENT(now);
+		INSTR_TIME_SUBTRACT(now, start);
+		remain = usec - (int64) INSTR_TIME_GET_MICROSEC(now);
+
+		if (remain <= 0)
+		{
+			slept = usec - remain;
+			break;
+		}
+
+		if (remain < 1000)
+		{
+			pgstat_report_wait_start(wait_event_info);
+			pg_usleep((long) remain);
+			pgstat_report_wait_end();
+			continue;
+		}
+
+		/* WaitLatch reports the wait event by itself */
+		rc = WaitLatch(MyLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   (long) (remain / 1000),
+					   wait_event_info);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		if (rc & WL_LATCH_SET)
+			ResetLatch(MyLatch);
+	}
+
+	if (new_status != NULL)
+	{
+		set_ps_display(new_status, false);
+		pfree(new_status);
+	}
+
+	return slept;
+}
+
+/*
+ * Draw a wait time in microseconds from the distribution of the event.
+ *
+ * usec is the mean of all distributions. jitter is the standard deviation
+ * of normal distribution and the half width of uniform distribution. The
+ * pareto distribution has the scale chosen so that its mean is usec, and
+ * smaller shape gives heavier p99/p999 tail.
+ */
+static int64
+sampleWaitTime(const SimulaEvent *event)
+{
+	double	mean = (double) event->usec;
+	double	u;
+	double	delay;
+
+	switch (event->distribution)
+	{
+		case SIMULA_DIST_UNIFORM:
+			delay = mean + (2.0 * simula_random_double() - 1.0) * event->jitter;
+			break;
+
+		case SIMULA_DIST_NORMAL:
+			/* Box-Muller transform. Use (0, 1] to avoid log(0) */
+			u = 1.0 - simula_random_double();
+			delay = mean + event->jitter *
+				sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * simula_random_double());
+			break;
+
+		case SIMULA_DIST_EXPONENTIAL:
+			delay = -mean * log(1.0 - simula_random_double());
+			break;
+
+		case SIMULA_DIST_PARETO:
+			u = 1.0 - simula_random_double();
+			delay = mean * (event->shape - 1.0) / event->shape /
+				pow(u, 1.0 / event->shape);
+			break;
+
+		case SIMULA_DIST_FIXED:
+		default:
+			return event->usec;
+	}
+
+	if (delay <= 0)
+		return 0;
+	if (delay >= (double) (PG_INT64_MAX / 2))
+		return PG_INT64_MAX / 2;
+
+	return (int64) delay;
+}
+
+/*
+ * Return a pseudo random number from the per-backend xorshift64* generator.
+ * This doesn't need to be a good random number, but must be cheap enough
+ * to be called for each statement.
+ */
+static uint64
+simula_random(void)
+{
+	uint64	x = simula_prng_state;
+
+	if (x == 0)
+	{
+		x = ((uint64) MyProcPid << 32) ^ (uint64) GetCurrentTimestamp();
+		if (x == 0)
+			x = UINT64CONST(0x9E3779B97F4A7C15);
+	}
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	simula_prng_state = x;
+
+	return x * UINT64CONST(0x2545F4914F6CDD1D);
+}
+
+/* Return a pseudo random number in [0, 1) */
+static double
+simula_random_double(void)
+{
+	return (double) (simula_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Scenario worker
+ *
+ * The worker runs pg_simula.scenario_script, which is a text file having one
+ * step per line:
+ *
+ *	set <operation> <action> [<parameter>=<value> ...]
+ *	unset [<operation> [<parameter>=<value> ...]]
+ *	sleep <interval>
+ *	repeat
+ *
+ * where the parameters are the columns of simula_events in the same text
+ * form. unset takes only relation, queryid and database, which identify the
+ * event with the operation. An operation including spaces is quoted by
+ * double quotes. The events are for all databases and written to the shared
+ * catalog directly, so no session needs to modify simula_events during the
+ * scenario.
+ */
+typedef enum ScenarioStepKind
+{
+	SCENARIO_SET,
+	SCENARIO_UNSET,
+	SCENARIO_SLEEP,
+	SCENARIO_REPEAT
+} ScenarioStepKind;
+
+typedef struct ScenarioStep
+{
+	ScenarioStepKind kind;
+	SimulaEvent event;		/* SET, or the operation of UNSET */
+	int64	usec;			/* SLEEP */
+} ScenarioStep;
+
+/* Error context of loading the scenario script */
+typedef struct ScenarioContext
+{
+	const char *path;
+	int		lineno;
+} ScenarioContext;
+
+/*
+ * Replay control
+ *
+ * On a standby, the scenario worker delays the WAL replay as REPLAY event
+ * says, since the startup process has no hook. The replay is paused while
+ * the replayed WAL is newer than the WAL received the wait time ago, or
+ * more WAL than rate bytes has been replayed in the current second. While
+ * paused, the startup process checks the pause only every second, so the
+ * delay is accurate to about a second.
+ */
+#define REPLAY_CONTROL_INTERVAL	10		/* ms */
+#define REPLAY_HISTORY_SIZE		65536
+
+/* The received WAL position at a time */
+typedef struct ReplaySample
+{
+	TimestampTz	time;
+	XLogRecPtr	lsn;
+} ReplaySample;
+
+typedef struct ReplayControl
+{
+	uint64		generation;	/* of the shared catalog event is taken from */
+	int			slot;		/* slot of REPLAY event, or -1 if none */
+	SimulaEventEntry entry;	/* REPLAY event and its time window */
+	bool		paused;		/* replay paused by us? */
+	TimestampTz	paused_at;
+	int64		delay;		/* wait time sampled for the current second */
+	TimestampTz	window_start;	/* start of the second for rate */
+	XLogRecPtr	window_lsn;		/* replayed position at window_start */
+	int			head;			/* next sample to write */
+	int			nsamples;
+	ReplaySample samples[REPLAY_HISTORY_SIZE];
+} ReplayControl;
+
+/*
+ * Get the application_name this standby connects to the primary with, which
+ * identifies the standby in pg_stat_replication and synchronous_standby_names.
+ */
+static void
+getStandbyName(char *name)
+{
+	char	conninfo[MAXCONNINFO];
+	char   *p;
+
+	SpinLockAcquire(&WalRcv->mutex);
+	memcpy(conninfo, (char *) WalRcv->conninfo, MAXCONNINFO);
+	SpinLockRelease(&WalRcv->mutex);
+	conninfo[MAXCONNINFO - 1] = '\0';
+
+	/* Not to match fallback_application_name */
+	for (p = strstr(conninfo, "application_name="); p != NULL;
+		 p = strstr(p + 1, "application_name="))
+	{
+		if (p == conninfo || p[-1] == ' ')
+		{
+			int		i;
+
+			p += strlen("application_name=");
+			for (i = 0; i < NAMEDATALEN - 1 && p[i] != '\0' && p[i] != ' '; i++)
+				name[i] = p[i];
+			name[i] = '\0';
+			return;
+		}
+	}
+
+	strlcpy(name, "walreceiver", NAMEDATALEN);
+}
+
+/* Find REPLAY event for this standby if the shared catalog has changed */
+static void
+findReplayEvent(ReplayControl *ctl)
+{
+	uint64	generation = pg_atomic_read_u64(&simula_state->generation);
+	char	standby_name[NAMEDATALEN];
+	int		i;
+
+	if (ctl->generation == generation)
+		return;
+
+	getStandbyName(standby_name);
+
+	LWLockAcquire(simula_state->lock, LW_SHARED);
+
+	ctl->slot = -1;
+	for (i = 0; i < simula_state->nslots; i++)
+	{
+		SimulaEvent *event = &(simula_state->slots[i].event);
+
+		if (simula_state->slots[i].in_use &&
+			strcmp(event->operation, SIMULA_OP_REPLAY) == 0 &&
+			(event->appname[0] == '\0' ||
+			 strcmp(event->appname, standby_name) == 0))
+		{
+			ctl->slot = i;
+			ctl->entry.event = *event;
+			ctl->entry.scheduled = (event->start_at != DT_NOBEGIN ||
+									event->stop_at != DT_NOEND ||
+									event->period > 0);
+			ctl->entry.in_window = true;
+			ctl->entry.toggle_at = DT_NOBEGIN;
+
+			/* The events of the table take precedence */
+			if (event->source == SIMULA_SOURCE_TABLE)
+				break;
+		}
+	}
+
+	ctl->generation = generation;
+
+	LWLockRelease(simula_state->lock);
+}
+
+/*
+ * Pause or resume the replay, and count the pauses in the statistics. Only
+ * the pause made by us is resumed, so that the pause made by somebody else,
+ * e.g. pg_wal_replay_pause(), is left alone.
+ */
+static void
+setReplayPause(ReplayControl *ctl, bool pause)
+{
+	TimestampTz now = GetCurrentTimestamp();
+
+	/* Our pause has been resumed by somebody else */
+	if (ctl->paused && !RecoveryIsPaused())
+		pause = false;
+	else if (pause == ctl->paused)
+		return;
+	else if (pause)
+	{
+		if (RecoveryIsPaused())
+			return;
+		SetRecoveryPause(true);
+	}
+	else
+		SetRecoveryPause(false);
+
+	if (ctl->slot >= 0)
+	{
+		SimulaSlot *slot = &(simula_state->slots[ctl->slot]);
+
+		if (pause)
+		{
+			pg_atomic_fetch_add_u64(&slot->stats.matches, 1);
+			pg_atomic_fetch_add_u64(&slot->stats.fires, 1);
+		}
+		else
+		{
+			uint64	delay = (uint64) (now - ctl->paused_at);
+
+			pg_atomic_fetch_add_u64(&slot->stats.total_delay, delay);
+			atomic_max_u64(&slot->stats.max_delay, delay);
+		}
+	}
+
+	ctl->paused = pause;
+	ctl->paused_at = now;
+}
+
+/*
+ * Control the replay as REPLAY event. Return true if the replay needs to be
+ * checked again after REPLAY_CONTROL_INTERVAL.
+ */
+static bool
+controlReplay(ReplayControl *ctl)
+{
+	TimestampTz	now;
+	XLogRecPtr	received;
+	XLogRecPtr	replayed;
+	bool		pause = false;
+
+	findReplayEvent(ctl);
+
+	/*
+	 * Publishing the event later sets our latch, and enabling the simulation
+	 * reloads the configuration, so we don't need to poll until then.
+	 */
+	if (ctl->slot < 0 || !simulation_enabled)
+	{
+		setReplayPause(ctl, false);
+		return false;
+	}
+
+	now = GetCurrentTimestamp();
+	received = GetWalRcvWriteRecPtr(NULL, NULL);
+	replayed = GetXLogReplayRecPtr(NULL);
+
+	if (ctl->entry.scheduled && now >= ctl->entry.toggle_at)
+		updateEventWindow(&ctl->entry, now);
+
+	/* Remember when the WAL was received */
+	if (ctl->nsamples == 0 ||
+		ctl->samples[(ctl->head + REPLAY_HISTORY_SIZE - 1) % REPLAY_HISTORY_SIZE].lsn < received)
+	{
+		ctl->samples[ctl->head].time = now;
+		ctl->samples[ctl->head].lsn = received;
+		ctl->head = (ctl->head + 1) % REPLAY_HISTORY_SIZE;
+		ctl->nsamples = Min(ctl->nsamples + 1, REPLAY_HISTORY_SIZE);
+	}
+
+	/* A new second begins */
+	if (now - ctl->window_start >= USECS_PER_SEC)
+	{
+		ctl->window_start = now;
+		ctl->window_lsn = replayed;
+		ctl->delay = sampleWaitTime(&ctl->entry.event);
+	}
+
+	if (!ctl->entry.in_window)
+	{
+		setReplayPause(ctl, false);
+		return true;
+	}
+
+	if (ctl->entry.event.rate > 0 &&
+		(double) (replayed - Min(replayed, ctl->window_lsn)) >= ctl->entry.event.rate)
+		pause = true;
+
+	if (ctl->delay > 0)
+	{
+		XLogRecPtr	target = InvalidXLogRecPtr;
+		int		i;
+
+		/* The newest WAL position received the wait time ago */
+		for (i = 1; i <= ctl->nsamples; i++)
+		{
+			ReplaySample *sample = &(ctl->samples[(ctl->head + REPLAY_HISTORY_SIZE - i) % REPLAY_HISTORY_SIZE]);
+
+			if (sample->time <= now - ctl->delay)
+			{
+				target = sample->lsn;
+				break;
+			}
+		}
+
+		/* The wait time is longer than the history; delay as much as we can */
+		if (target == InvalidXLogRecPtr && ctl->nsamples == REPLAY_HISTORY_SIZE)
+			target = ctl->samples[ctl->head].lsn;
+
+		if (replayed >= target)
+			pause = true;
+	}
+
+	setReplayPause(ctl, pause);
+
+	return true;
+}
+
+static volatile sig_atomic_t got_sighup = false;
+static volatile sig_atomic_t got_sigterm = false;
+
+#define MAX_SCENARIO_TOKENS	32
+
+static void
+pg_simula_worker_sighup(SIGNAL_ARGS)
+{
+	int		save_errno = errno;
+
+	got_sighup = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+static void
+pg_simula_worker_sigterm(SIGNAL_ARGS)
+{
+	int		save_errno = errno;
+
+	got_sigterm = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+/* Stop being woken up by the catalog changes */
+static void
+pg_simula_worker_exit(int code, Datum arg)
+{
+	LWLockAcquire(simula_state->lock, LW_EXCLUSIVE);
+	if (simula_state->worker_latch == MyLatch)
+		simula_state->worker_latch = NULL;
+	LWLockRelease(simula_state->lock);
+}
+
+static void
+scenario_error_callback(void *arg)
+{
+	ScenarioContext *context = (ScenarioContext *) arg;
+
+	errcontext("line %d of scenario script \"%s\"",
+			   context->lineno, context->path);
+}
+
+/* Return the length of the given interval in text form in microseconds */
+static int64
+parseInterval(const char *value)
+{
+	Datum	span = DirectFunctionCall3(interval_in,
+									   CStringGetDatum(value),
+									   ObjectIdGetDatum(InvalidOid),
+									   Int32GetDatum(-1));
+
+	return intervalToUsec(DatumGetIntervalP(span));
+}
+
+/* Return the timestamp with time zone given in text form */
+static TimestampTz
+parseTimestamp(const char *value)
+{
+	return DatumGetTimestampTz(DirectFunctionCall3(timestamptz_in,
+												   CStringGetDatum(value),
+												   ObjectIdGetDatum(InvalidOid),
+												   Int32GetDatum(-1)));
+}
+
+/*
+ * Set the parameter of the event given by the name of the column of
+ * simula_events and the value in text form. Raise an error if invalid.
+ */
+static void
+setEventParam(SimulaEvent *event, const char *name, const char *value)
+{
+	if (strcmp(name, "sec") == 0)
+		event->usec += (int64) pg_atoi(value, sizeof(int32), 0) * USECS_PER_SEC;
+	else if (strcmp(name, "usec") == 0)
+		event->usec += DatumGetInt64(DirectFunctionCall1(int8in,
+														 CStringGetDatum(value)));
+	else if (strcmp(name, "distribution") == 0)
+	{
+		int		dist = lookupDistribution(value);
+
+		if (dist < 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid distribution: \"%s\"", value)));
+		event->distribution = (SimulaDistribution) dist;
+	}
+	else if (strcmp(name, "jitter") == 0)
+		event->jitter = DatumGetInt64(DirectFunctionCall1(int8in,
+														  CStringGetDatum(value)));
+	else if (strcmp(name, "shape") == 0)
+		event->shape = DatumGetFloat8(DirectFunctionCall1(float8in,
+														  CStringGetDatum(value)));
+	else if (strcmp(name, "probability") == 0)
+		event->probability = DatumGetFloat8(DirectFunctionCall1(float8in,
+																CStringGetDatum(value)));
+	else if (strcmp(name, "first_block") == 0)
+		event->first_block = DatumGetInt64(DirectFunctionCall1(int8in,
+															   CStringGetDatum(value)));
+	else if (strcmp(name, "last_block") == 0)
+		event->last_block = DatumGetInt64(DirectFunctionCall1(int8in,
+															  CStringGetDatum(value)));
+	else if (strcmp(name, "rate") == 0)
+		event->rate = DatumGetFloat8(DirectFunctionCall1(float8in,
+														 CStringGetDatum(value)));
+	else if (strcmp(name, "relation") == 0)
+		event->relid = DatumGetObjectId(DirectFunctionCall1(oidin,
+															CStringGetDatum(value)));
+	else if (strcmp(name, "start_at") == 0)
+		event->start_at = parseTimestamp(value);
+	else if (strcmp(name, "stop_at") == 0)
+		event->stop_at = parseTimestamp(value);
+	else if (strcmp(name, "period") == 0)
+		event->period = parseInterval(value);
+	else if (strcmp(name, "active") == 0)
+		event->active = parseInterval(value);
+	else if (strcmp(name, "queryid") == 0)
+		event->queryid = DatumGetInt64(DirectFunctionCall1(int8in,
+														   CStringGetDatum(value)));
+	else if (strcmp(name, "skip") == 0)
+		event->skip = DatumGetInt64(DirectFunctionCall1(int8in,
+														CStringGetDatum(value)));
+	else if (strcmp(name, "times") == 0)
+		event->times = DatumGetInt64(DirectFunctionCall1(int8in,
+														 CStringGetDatum(value)));
+	else if (strcmp(name, "role") == 0)
+		event->roleid = DatumGetObjectId(DirectFunctionCall1(oidin,
+															 CStringGetDatum(value)));
+	else if (strcmp(name, "database") == 0)
+		event->datid = DatumGetObjectId(DirectFunctionCall1(oidin,
+															CStringGetDatum(value)));
+	else if (strcmp(name, "size_mb") == 0)
+		event->size_mb = pg_atoi(value, sizeof(int32), 0);
+	else if (strcmp(name, "lock_target") == 0 || strcmp(name, "lock_mode") == 0)
+	{
+		/* The worker has no database to look up relation names */
+		const char *problem = (name[5] == 't') ?
+			parseLockTarget(event, value, false) :
+			parseLockMode(event, value);
+
+		if (problem != NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("%s", problem)));
+	}
+	else if (strcmp(name, "application_name") == 0)
+	{
+		if (strlen(value) >= NAMEDATALEN)
+			ereport(ERROR,
+					(errcode(ERRCODE_NAME_TOO_LONG),
+					 errmsg("application_name \"%s\" is too long", value)));
+		strlcpy(event->appname, value, NAMEDATALEN);
+	}
+	else
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("unrecognized parameter \"%s\"", name)));
+}
+
+/* Raise an error if the event is invalid */
+static void
+validateEvent(const SimulaEvent *event)
+{
+	const char *problem = checkEvent(event);
+
+	if (problem != NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid simulation event for \"%s\": %s",
+						event->operation, problem)));
+}
+
+/*
+ * Split the line into tokens separated by white spaces in place. A token
+ * can be quoted by double quotes. Return the number of tokens.
+ */
+static int
+tokenizeScenarioLine(char *line, char **tokens)
+{
+	int		ntokens = 0;
+	char   *p = line;
+
+	for (;;)
+	{
+		while (isspace((unsigned char) *p))
+			p++;
+		if (*p == '\0' || *p == '#')
+			break;
+
+		if (ntokens >= MAX_SCENARIO_TOKENS)
+			ereport(ERROR,
+					(errcode(ERRCODE_SYNTAX_ERROR),
+					 errmsg("too many tokens")));
+
+		if (*p == '"')
+		{
+			tokens[ntokens++] = ++p;
+			while (*p != '\0' && *p != '"')
+				p++;
+			if (*p == '\0')
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("unterminated quoted string")));
+		}
+		else
+		{
+			tokens[ntokens++] = p;
+			while (*p != '\0' && !isspace((unsigned char) *p))
+				p++;
+			if (*p == '\0')
+				break;
+		}
+
+		*p++ = '\0';
+	}
+
+	return ntokens;
+}
+
+/* Parse a line of the scenario script. Return false if it has no step. */
+static bool
+parseScenarioLine(char *line, ScenarioStep *step)
+{
+	char   *tokens[MAX_SCENARIO_TOKENS];
+	int		ntokens = tokenizeScenarioLine(line, tokens);
+	int		i;
+
+	if (ntokens == 0)
+		return false;
+
+	memset(step, 0, sizeof(ScenarioStep));
+
+	if (pg_strcasecmp(tokens[0], "set") == 0 && ntokens >= 3)
+	{
+		step->kind = SCENARIO_SET;
+		initEvent(&step->event, SIMULA_SOURCE_SCRIPT, tokens[1], tokens[2]);
+
+		for (i = 3; i < ntokens; i++)
+		{
+			char   *value = strchr(tokens[i], '=');
+
+			if (value == NULL)
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("invalid parameter \"%s\"", tokens[i])));
+			*value++ = '\0';
+			setEventParam(&step->event, tokens[i], value);
+		}
+
+		validateEvent(&step->event);
+	}
+	else if (pg_strcasecmp(tokens[0], "unset") == 0)
+	{
+		step->kind = SCENARIO_UNSET;
+		if (ntokens >= 2)
+			initEvent(&step->event, SIMULA_SOURCE_SCRIPT, tokens[1], "wait");
+
+		for (i = 2; i < ntokens; i++)
+		{
+			char   *value = strchr(tokens[i], '=');
+
+			if (value == NULL)
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("invalid parameter \"%s\"", tokens[i])));
+			*value++ = '\0';
+			if (strcmp(tokens[i], "relation") != 0 &&
+				strcmp(tokens[i], "queryid") != 0 &&
+				strcmp(tokens[i], "database") != 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("unset does not accept parameter \"%s\"",
+								tokens[i])));
+			setEventParam(&step->event, tokens[i], value);
+		}
+	}
+	else if (pg_strcasecmp(tokens[0], "sleep") == 0 && ntokens == 2)
+	{
+		step->kind = SCENARIO_SLEEP;
+		step->usec = parseInterval(tokens[1]);
+	}
+	else if (pg_strcasecmp(tokens[0], "repeat") == 0 && ntokens == 1)
+		step->kind = SCENARIO_REPEAT;
+	else
+		ereport(ERROR,
+				(errcode(ERRCODE_SYNTAX_ERROR),
+				 errmsg("invalid scenario step \"%s\"", tokens[0])));
+
+	return true;
+}
+
+/*
+ * Read the scenario script into an array of steps allocated in cxt. If the
+ * script cannot be read or has an error, the error is logged and no step is
+ * returned.
+ */
+static ScenarioStep *
+loadScenarioScript(MemoryContext cxt, const char *path, int *nsteps)
+{
+	ScenarioStep *steps = NULL;
+	int		maxsteps = 16;
+	bool	slept = false;
+	FILE   *file;
+	char	line[1024];
+	ScenarioContext context;
+	ErrorContextCallback errcallback;
+	MemoryContext oldcxt;
+
+	*nsteps = 0;
+
+	if (path == NULL || path[0] == '\0')
+		return NULL;
+
+	if ((file = AllocateFile(path, "r")) == NULL)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not open scenario script \"%s\": %m", path)));
+		return NULL;
+	}
+
+	context.path = path;
+	context.lineno = 0;
+	errcallback.callback = scenario_error_callback;
+	errcallback.arg = &context;
+
+	oldcxt = MemoryContextSwitchTo(cxt);
+
+	PG_TRY();
+	{
+		errcallback.previous = error_context_stack;
+		error_context_stack = &errcallback;
+
+		steps = palloc(sizeof(ScenarioStep) * maxsteps);
+
+		while (fgets(line, sizeof(line), file) != NULL)
+		{
+			context.lineno++;
+
+			if (*nsteps >= maxsteps)
+			{
+				maxsteps *= 2;
+				steps = repalloc(steps, sizeof(ScenarioStep) * maxsteps);
+			}
+
+			if (!parseScenarioLine(line, &steps[*nsteps]))
+				continue;
+
+			/* It would be a busy loop */
+			if (steps[*nsteps].kind == SCENARIO_SLEEP &&
+				steps[*nsteps].usec > 0)
+				slept = true;
+			else if (steps[*nsteps].kind == SCENARIO_REPEAT && !slept)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("repeat must follow a sleep")));
+
+			(*nsteps)++;
+		}
+
+		error_context_stack = errcallback.previous;
+	}
+	PG_CATCH();
+	{
+		error_context_stack = errcallback.previous;
+		MemoryContextSwitchTo(oldcxt);
+		EmitErrorReport();
+		FlushErrorState();
+
+		*nsteps = 0;
+		steps = NULL;
+	}
+	PG_END_TRY();
+
+	MemoryContextSwitchTo(oldcxt);
+	FreeFile(file);
+
+	return steps;
+}
+
+/*
+ * Return true if the events of the scenario are the same one. They are
+ * identified by the primary key of simula_events, and the database since the
+ * scenario is for all databases.
+ */
+static bool
+sameScenarioEvent(const SimulaEvent *a, const SimulaEvent *b)
+{
+	return (strcmp(a->operation, b->operation) == 0 &&
+			a->relid == b->relid &&
+			a->queryid == b->queryid &&
+			a->datid == b->datid);
+}
+
+/* Apply the SET or UNSET step to the events of the scenario */
+static void
+applyScenarioStep(ScenarioStep *step, SimulaEvent *events, int *nevents)
+{
+	int		i;
+
+	if (step->kind == SCENARIO_UNSET && step->event.operation[0] == '\0')
+	{
+		*nevents = 0;
+		return;
+	}
+
+	for (i = 0; i < *nevents; i++)
+	{
+		if (sameScenarioEvent(&events[i], &step->event))
+			break;
+	}
+
+	if (step->kind == SCENARIO_UNSET)
+	{
+		if (i < *nevents)
+			events[i] = events[--(*nevents)];
+	}
+	else if (i < *nevents)
+		events[i] = step->event;
+	else if (*nevents < max_events)
+		events[(*nevents)++] = step->event;
+}
+
+/*
+ * Main function of the scenario worker. The script is run from the start
+ * again when the configuration is reloaded.
+ */
+void
+pg_simula_worker_main(Datum main_arg)
+{
+	MemoryContext cxt;
+	ScenarioStep *steps = NULL;
+	int		nsteps = 0;
+	SimulaEvent *events = NULL;
+	int		nevents = 0;
+	int		pc = 0;
+	TimestampTz wakeup = 0;
+	SimulaEvent *file_events;
+	int		nfile_events;
+	MemoryContext oldcxt;
+	ReplayControl *replay;
+
+	pqsignal(SIGHUP, pg_simula_worker_sighup);
+	pqsignal(SIGTERM, pg_simula_worker_sigterm);
+	BackgroundWorkerUnblockSignals();
+
+	/* Be woken up when the catalog is changed */
+	LWLockAcquire(simula_state->lock, LW_EXCLUSIVE);
+	simula_state->worker_latch = MyLatch;
+	LWLockRelease(simula_state->lock);
+	before_shmem_exit(pg_simula_worker_exit, (Datum) 0);
+
+	cxt = AllocSetContextCreate(TopMemoryContext,
+								"pg_simula scenario",
+								ALLOCSET_DEFAULT_SIZES);
+
+	replay = MemoryContextAllocZero(TopMemoryContext, sizeof(ReplayControl));
+	replay->slot = -1;
+
+	/* Load the script first */
+	got_sighup = true;
+
+	while (!got_sigterm)
+	{
+		long	timeout = -1;
+		bool	changed = false;
+		int		rc;
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+
+			MemoryContextReset(cxt);
+
+			/* The file might have been changed too */
+			oldcxt = MemoryContextSwitchTo(cxt);
+			file_events = loadScenarioFile(scenario_file, &nfile_events);
+			publishScenarioEvents(SIMULA_SOURCE_FILE, file_events,
+								  nfile_events);
+			MemoryContextSwitchTo(oldcxt);
+
+			steps = loadScenarioScript(cxt, scenario_script, &nsteps);
+			events = MemoryContextAlloc(cxt, sizeof(SimulaEvent) * max_events);
+			nevents = 0;
+			pc = 0;
+			wakeup = 0;
+			changed = true;
+		}
+
+		/* Run the steps until the next sleep */
+		while (pc < nsteps)
+		{
+			ScenarioStep *step = &steps[pc];
+
+			if (step->kind == SCENARIO_SLEEP)
+			{
+				TimestampTz now = GetCurrentTimestamp();
+
+				if (wakeup == 0)
+					wakeup = now + step->usec;
+				if (now < wakeup)
+				{
+					timeout = (long) ((wakeup - now + 999) / 1000);
+					break;
+				}
+				wakeup = 0;
+				pc++;
+			}
+			else if (step->kind == SCENARIO_REPEAT)
+				pc = 0;
+			else
+			{
+				applyScenarioStep(step, events, &nevents);
+				changed = true;
+				pc++;
+			}
+		}
+
+		if (changed)
+			publishScenarioEvents(SIMULA_SOURCE_SCRIPT, events, nevents);
+
+		/* The pause is cleared by promotion */
+		if (!RecoveryInProgress())
+			replay->paused = false;
+		else if (controlReplay(replay))
+			timeout = (timeout < 0) ? REPLAY_CONTROL_INTERVAL :
+				Min(timeout, REPLAY_CONTROL_INTERVAL);
+
+		rc = WaitLatch(MyLatch,
+					   WL_LATCH_SET | WL_POSTMASTER_DEATH |
+					   (timeout >= 0 ? WL_TIMEOUT : 0),
+					   timeout, SIMULA_WAIT_SCENARIO);
+		ResetLatch(MyLatch);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+	}
+
+	/* Recover from the faults */
+	publishScenarioEvents(SIMULA_SOURCE_SCRIPT, NULL, 0);
+	if (RecoveryInProgress())
+		setReplayPause(replay, false);
+
+	proc_exit(0);
+}
+
+/*
+ * Scenario file
+ *
+ * pg_simula.scenario_file is a JSON array of objects, each of which is an
+ * event having "operation", "action" and the other columns of simula_events
+ * as the keys, for instance:
+ *
+ *	[{"operation": "SELECT", "action": "wait", "usec": 1000},
+ *	 {"operation": "INSERT", "action": "error", "probability": 0.01}]
+ *
+ * The events are for all databases. The file is loaded into the shared
+ * catalog when it's created at server start, and by the scenario worker when
+ * the configuration is reloaded.
+ */
+#define MAX_SCENARIO_FIELDS	32
+
+typedef struct ScenarioFileState
+{
+	int		depth;			/* nesting level of arrays and objects */
+	char   *field;			/* name of the current field */
+	int		nfields;		/* the fields of the current object */
+	char   *names[MAX_SCENARIO_FIELDS];
+	char   *values[MAX_SCENARIO_FIELDS];
+	SimulaEvent *events;
+	int		nevents;
+	int		maxevents;
+} ScenarioFileState;
+
+static void
+scenario_array_start(void *state)
+{
+	ScenarioFileState *fstate = (ScenarioFileState *) state;
+
+	if (++fstate->depth != 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("scenario file must be an array of objects")));
+}
+
+static void
+scenario_array_end(void *state)
+{
+	((ScenarioFileState *) state)->depth--;
+}
+
+static void
+scenario_object_start(void *state)
+{
+	ScenarioFileState *fstate = (ScenarioFileState *) state;
+
+	if (++fstate->depth != 2)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("scenario file must be an array of objects")));
+
+	fstate->nfields = 0;
+}
+
+/* Make an event of the fields of the object */
+static void
+scenario_object_end(void *state)
+{
+	ScenarioFileState *fstate = (ScenarioFileState *) state;
+	char   *operation = NULL;
+	char   *action = NULL;
+	SimulaEvent *event;
+	int		i;
+
+	fstate->depth--;
+
+	for (i = 0; i < fstate->nfields; i++)
+	{
+		if (strcmp(fstate->names[i], "operation") == 0)
+			operation = fstate->values[i];
+		else if (strcmp(fstate->names[i], "action") == 0)
+			action = fstate->values[i];
+	}
+
+	if (operation == NULL || action == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("event in scenario file must have operation and action")));
+
+	if (fstate->nevents >= fstate->maxevents)
+	{
+		fstate->maxevents *= 2;
+		fstate->events = repalloc(fstate->events,
+								  sizeof(SimulaEvent) * fstate->maxevents);
+	}
+
+	event = &(fstate->events[fstate->nevents++]);
+	initEvent(event, SIMULA_SOURCE_FILE, operation, action);
+
+	for (i = 0; i < fstate->nfields; i++)
+	{
+		if (strcmp(fstate->names[i], "operation") != 0 &&
+			strcmp(fstate->names[i], "action") != 0)
+			setEventParam(event, fstate->names[i], fstate->values[i]);
+	}
+
+	validateEvent(event);
+}
+
+static void
+scenario_object_field_start(void *state, char *fname, bool isnull)
+{
+	((ScenarioFileState *) state)->field = fname;
+}
+
+static void
+scenario_scalar(void *state, char *token, JsonTokenType tokentype)
+{
+	ScenarioFileState *fstate = (ScenarioFileState *) state;
+
+	if (fstate->depth != 2)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("scenario file must be an array of objects")));
+
+	/* null means the default */
+	if (tokentype == JSON_TOKEN_NULL)
+		return;
+
+	if (fstate->nfields >= MAX_SCENARIO_FIELDS)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("too many fields in an event of scenario file")));
+
+	fstate->names[fstate->nfields] = fstate->field;
+	fstate->values[fstate->nfields] = token;
+	fstate->nfields++;
+}
+
+/*
+ * Read the events in the scenario file into an array allocated in the
+ * current memory context. If the file cannot be read or has an error, the
+ * error is logged and no event is returned.
+ */
+static SimulaEvent *
+loadScenarioFile(const char *path, int *nevents)
+{
+	ScenarioFileState fstate;
+	JsonSemAction sem;
+	StringInfoData buf;
+	MemoryContext cxt = CurrentMemoryContext;
+	bool	failed = false;
+	FILE   *file;
+	char	chunk[8192];
+	size_t	len;
+
+	*nevents = 0;
+
+	if (path == NULL || path[0] == '\0')
+		return NULL;
+
+	if ((file = AllocateFile(path, PG_BINARY_R)) == NULL)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not open scenario file \"%s\": %m", path)));
+		return NULL;
+	}
+
+	initStringInfo(&buf);
+	while ((len = fread(chunk, 1, sizeof(chunk), file)) > 0)
+		appendBinaryStringInfo(&buf, chunk, len);
+	FreeFile(file);
+
+	memset(&fstate, 0, sizeof(fstate));
+	fstate.maxevents = 16;
+	fstate.events = palloc(sizeof(SimulaEvent) * fstate.maxevents);
+
+	memset(&sem, 0, sizeof(sem));
+	sem.semstate = &fstate;
+	sem.array_start = scenario_array_start;
+	sem.array_end = scenario_array_end;
+	sem.object_start = scenario_object_start;
+	sem.object_end = scenario_object_end;
+	sem.object_field_start = scenario_object_field_start;
+	sem.scalar = scenario_scalar;
+
+	PG_TRY();
+	{
+		pg_parse_json(makeJsonLexContextCstringLen(buf.data, buf.len, true),
+					  &sem);
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(cxt);
+		EmitErrorReport();
+		FlushErrorState();
+		failed = true;
+	}
+	PG_END_TRY();
+
+	if (failed)
+	{
+		ereport(LOG,
+				(errmsg("ignored scenario file \"%s\" having an error", path)));
+		return NULL;
+	}
+
+	*nevents = fstate.nevents;
+
+	return fstate.events;
+}
@@ -0,0 +1,93 @@
+SET pg_simula.enabled = on;
+CREATE TABLE a (id int);
+CREATE TABLE b (id int);
+-- ERROR and WAIT
+SELECT add_simula_event('INSERT', 'ERROR', 0);
+SELECT add_simula_event('UPDATE', 'WAIT', 0, usec => 100000);
+INSERT INTO a VALUES (1);
+UPDATE a SET id = id;
+SELECT operation, action, matches, fires, errors, total_delay >= 100000 AS waited
+  FROM pg_simula_stats WHERE dbid <> 0 ORDER BY operation;
+SELECT pg_simula_stats_reset();
+SELECT operation, matches, fires, errors, total_delay
+  FROM pg_simula_stats WHERE dbid <> 0 ORDER BY operation;
+SELECT clear_all_events();
+SELECT count(*) FROM pg_simula_stats WHERE dbid <> 0;
+-- probability
+SELECT add_simula_event('INSERT', 'ERROR', 0, probability => 0);
+INSERT INTO a VALUES (1);
+INSERT INTO a VALUES (2);
+SELECT matches, fires FROM pg_simula_stats WHERE operation = 'INSERT';
+SELECT clear_all_events();
+-- skip and times
+SELECT add_simula_event('INSERT', 'ERROR', 0, skip => 1, times => 1);
+INSERT INTO a VALUES (3);
+INSERT INTO a VALUES (4);
+INSERT INTO a VALUES (5);
+SELECT clear_all_events();
+-- relation
+SELECT add_simula_event('INSERT', 'ERROR', 0, relation => 'b');
+INSERT INTO a VALUES (6);
+INSERT INTO b VALUES (6);
+SELECT clear_all_events();
+-- queryid, which pg_stat_statements computes
+CREATE EXTENSION pg_stat_statements;
+CREATE TABLE q AS SELECT generate_series(1, 10) AS id;
+SELECT count(*) FROM q WHERE id = 1;
+SELECT queryid AS qid FROM pg_stat_statements
+  WHERE query = 'SELECT count(*) FROM q WHERE id = $1' \gset
+SELECT add_simula_event('SELECT', 'ERROR', 0, queryid => :qid);
+SELECT count(*) FROM q WHERE id = 2;
+SELECT count(*) FROM q;
+SELECT clear_all_events();
+DROP TABLE q;
+DROP EXTENSION pg_stat_statements;
+-- time window
+SELECT add_simula_event('UPDATE', 'ERROR', 0, start_at => now() + interval '1 day');
+SELECT add_simula_event('DELETE', 'ERROR', 0, stop_at => now() - interval '1 day');
+UPDATE a SET id = id;
+DELETE FROM b;
+SELECT clear_all_events();
+-- session filters
+SELECT add_simula_event('DELETE', 'ERROR', 0, application_name => 'victim');
+SELECT add_simula_event('TRUNCATE TABLE', 'ERROR', 0, database => 1);
+DELETE FROM b;
+SET application_name = 'victim';
+DELETE FROM b;
+RESET application_name;
+TRUNCATE b;
+SELECT clear_all_events();
+-- THROTTLE and THROTTLE_ROWS
+SELECT add_simula_event('INSERT', 'THROTTLE', 0, rate => 10);
+SELECT add_simula_event('UPDATE', 'THROTTLE_ROWS', 0, rate => 100);
+INSERT INTO a VALUES (7);
+INSERT INTO a VALUES (8);
+INSERT INTO a VALUES (9);
+UPDATE a SET id = id;
+UPDATE a SET id = id;
+SELECT operation, fires, total_delay > 0 AS throttled
+  FROM pg_simula_stats WHERE dbid <> 0 ORDER BY operation;
+SELECT clear_all_events();
+-- BURN
+SELECT add_simula_event('DELETE', 'BURN', 0, usec => 50000);
+DELETE FROM b;
+SELECT fires, total_delay >= 50000 AS burned
+  FROM pg_simula_stats WHERE operation = 'DELETE';
+SELECT clear_all_events();
+-- MEMORY
+SELECT add_simula_event('TRUNCATE TABLE', 'MEMORY', 0, size_mb => 16);
+TRUNCATE b;
+SELECT fires FROM pg_simula_stats WHERE operation = 'TRUNCATE TABLE';
+SELECT clear_all_events();
+-- HOLD_LOCK on an advisory lock and on an LWLock
+SELECT add_simula_event('VACUUM', 'HOLD_LOCK', 0, usec => 50000,
+						lock_target => 'advisory:42');
+SELECT add_simula_event('ANALYZE', 'HOLD_LOCK', 0, usec => 50000,
+						lock_target => 'lwlock:3', lock_mode => 'ShareLock');
+VACUUM b;
+ANALYZE b;
+SELECT operation, fires, total_delay >= 50000 AS held
+  FROM pg_simula_stats WHERE dbid <> 0 ORDER BY operation;
+SELECT count(*) FROM pg_locks WHERE locktype = 'advisory';
+SELECT clear_all_events();
+DROP TABLE a, b;
@@ -0,0 +1,11 @@
+-- auth_delay delays every new connection
+ALTER SYSTEM SET pg_simula.auth_delay = 700;
+SELECT pg_reload_conf();
+\c
+SELECT now() - backend_start >= interval '700 ms' AS delayed
+  FROM pg_stat_activity WHERE pid = pg_backend_pid();
+-- connection_refuse_percent refuses every other connection
+ALTER SYSTEM SET pg_simula.connection_refuse_percent = 50;
+SELECT pg_reload_conf();
+\c
+\c
@@ -0,0 +1,7 @@
+-- max_connections_per_sec refuses the connections exceeding the rate,
+-- and auth_delay lets the next test connect after the refused one
+ALTER SYSTEM RESET pg_simula.connection_refuse_percent;
+ALTER SYSTEM SET pg_simula.max_connections_per_sec = 1;
+SELECT pg_reload_conf();
+\c
+\c
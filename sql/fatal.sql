@@ -0,0 +1,7 @@
+ALTER SYSTEM RESET pg_simula.max_connections_per_sec;
+ALTER SYSTEM RESET pg_simula.auth_delay;
+SELECT pg_reload_conf();
+SET pg_simula.enabled = on;
+CREATE TABLE f (id int);
+SELECT add_simula_event('INSERT', 'FATAL', 0);
+INSERT INTO f VALUES (1);
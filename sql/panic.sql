@@ -0,0 +1,6 @@
+-- This must be the last test since the server restarts
+SET pg_simula.enabled = on;
+SELECT clear_all_events();
+INSERT INTO f VALUES (1);
+SELECT add_simula_event('VACUUM', 'PANIC', 0);
+VACUUM f;
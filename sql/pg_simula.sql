@@ -0,0 +1,82 @@
+CREATE EXTENSION pg_simula VERSION '1.0';
+SET pg_simula.enabled = on;
+CREATE TABLE t (id int);
+-- The events of version 1.0 are kept by the update
+SELECT add_simula_event('INSERT', 'ERROR', 0);
+INSERT INTO t VALUES (1);
+ALTER EXTENSION pg_simula UPDATE;
+INSERT INTO t VALUES (1);
+SELECT operation, action, sec, usec, distribution, probability
+  FROM simula_events;
+SELECT clear_all_events();
+INSERT INTO t VALUES (1);
+-- An event takes effect after the transaction adding it commits
+BEGIN;
+SELECT add_simula_event('INSERT', 'ERROR', 0);
+INSERT INTO t VALUES (2);
+COMMIT;
+INSERT INTO t VALUES (3);
+-- Nothing is done while disabled
+SET pg_simula.enabled = off;
+INSERT INTO t VALUES (3);
+SET pg_simula.enabled = on;
+SELECT count(*) FROM t;
+-- The events are shared by all sessions
+\c
+SET pg_simula.enabled = on;
+INSERT INTO t VALUES (4);
+-- Modifying the table directly takes effect after commit as well
+DELETE FROM simula_events;
+INSERT INTO t VALUES (4);
+INSERT INTO simula_events (operation, action, sec) VALUES ('UPDATE', 'ERROR', 0);
+\c
+SET pg_simula.enabled = on;
+UPDATE t SET id = id;
+TRUNCATE simula_events;
+UPDATE t SET id = id;
+-- Invalid events are rejected
+SELECT add_simula_event('INSERT', 'FOO', 0);
+SELECT add_simula_event('INSERT', 'WAIT', -1);
+SELECT add_simula_event('INSERT', 'WAIT', 0, distribution => 'foo');
+SELECT add_simula_event('INSERT', 'WAIT', 0, distribution => 'pareto', shape => 1);
+SELECT add_simula_event('INSERT', 'ERROR', 0, probability => 2);
+SELECT add_simula_event('PAGE READ', 'ERROR', 0, first_block => 10, last_block => 5);
+SELECT add_simula_event('SYNCREP WAIT', 'ERROR', 0);
+SELECT add_simula_event('INSERT', 'THROTTLE', 0);
+SELECT add_simula_event('INSERT', 'ERROR', 0, period => '1s', active => '2s');
+SELECT add_simula_event('PAGE READ', 'ERROR', 0, queryid => 1);
+SELECT add_simula_event('INSERT', 'ERROR', 0, skip => -1);
+SELECT add_simula_event('INSERT', 'MEMORY', 0);
+SELECT add_simula_event('INSERT', 'HOLD_LOCK', 1);
+SELECT add_simula_event('INSERT', 'HOLD_LOCK', 1, lock_target => 'lwlock:16');
+SELECT add_simula_event('INSERT', 'HOLD_LOCK', 1, lock_target => 'lwlock:0',
+						lock_mode => 'RowExclusiveLock');
+SELECT add_simula_event('REPLAY', 'ERROR', 0);
+SELECT count(*) FROM simula_events;
+-- An invalid event in the table is ignored with a warning
+INSERT INTO simula_events (operation, action, sec, distribution)
+  VALUES ('DELETE', 'WAIT', 0, 'pareto');
+DELETE FROM t WHERE id = 4;
+SELECT clear_all_events();
+-- Many events in one statement
+SELECT add_simula_events(ARRAY['INSERT', 'UPDATE'], ARRAY['ERROR', 'WAIT'], ARRAY[0, 0]);
+SELECT operation, action, sec FROM simula_events ORDER BY operation;
+SELECT array_agg(e) AS saved FROM simula_events e \gset
+SELECT clear_all_events();
+INSERT INTO t VALUES (5);
+SELECT add_simula_events(:'saved'::simula_events[]);
+SELECT operation, action, sec FROM simula_events ORDER BY operation;
+INSERT INTO t VALUES (6);
+-- An existing event is replaced as a whole
+SELECT add_simula_event('INSERT', 'WAIT', 1, probability => 0.5);
+SELECT add_simula_events(ARRAY['INSERT'], ARRAY['ERROR'], ARRAY[0]);
+SELECT operation, action, sec, probability FROM simula_events
+  WHERE operation = 'INSERT';
+INSERT INTO t VALUES (6);
+-- Invalid events are rejected
+SELECT add_simula_events(ARRAY['INSERT'], ARRAY['THROTTLE'], ARRAY[0]);
+SELECT add_simula_events(ARRAY['INSERT', 'UPDATE'], ARRAY['ERROR'], ARRAY[0, 0]);
+SELECT add_simula_events(ARRAY[json_populate_record(NULL::simula_events,
+	'{"operation": "DELETE", "action": "WAIT", "sec": -1}')]);
+SELECT count(*) FROM simula_events WHERE operation = 'DELETE';
+SELECT clear_all_events();
@@ -0,0 +1,34 @@
+SET pg_simula.enabled = on;
+CREATE TABLE p (id int);
+INSERT INTO p SELECT generate_series(1, 1000);
+-- PAGE READ
+SELECT add_simula_event('PAGE READ', 'WAIT', 0, usec => 1000, relation => 'p');
+SELECT count(*) FROM p;
+SELECT matches = pg_relation_size('p') / current_setting('block_size')::int AS per_page
+  FROM pg_simula_stats WHERE operation = 'PAGE READ';
+SELECT clear_all_events();
+SELECT add_simula_event('PAGE READ', 'ERROR', 0, relation => 'p', first_block => 2);
+SELECT count(*) FROM p;
+SELECT add_simula_event('PAGE READ', 'ERROR', 0, relation => 'p', first_block => 100);
+SELECT count(*) FROM p;
+SELECT clear_all_events();
+-- WAL FLUSH and SYNCREP WAIT, which is not done without synchronous standbys
+SELECT add_simula_event('SYNCREP WAIT', 'WAIT', 1);
+SELECT add_simula_event('WAL FLUSH', 'WAIT', 0, usec => 10000);
+INSERT INTO p VALUES (0);
+SELECT operation, matches, fires, total_delay >= 10000 AS waited
+  FROM pg_simula_stats WHERE dbid <> 0 ORDER BY operation;
+SELECT clear_all_events();
+-- REPLAY is not done on the primary
+SELECT add_simula_event('REPLAY', 'WAIT', 1);
+INSERT INTO p VALUES (0);
+SELECT matches, fires FROM pg_simula_stats WHERE operation = 'REPLAY';
+SELECT clear_all_events();
+-- PARALLEL WORKER
+SELECT add_simula_event('PARALLEL WORKER', 'ERROR', 0, relation => 'p');
+SET force_parallel_mode = regress;
+SELECT count(*) FROM p;
+RESET force_parallel_mode;
+SELECT count(*) FROM p;
+SELECT clear_all_events();
+DROP TABLE p;
@@ -0,0 +1,53 @@
+SET pg_simula.enabled = on;
+CREATE TABLE s (id int);
+-- Wait until the scenario worker has published the events, or removed them
+CREATE FUNCTION wait_for(cond text) RETURNS void AS $$
+DECLARE
+	done bool;
+BEGIN
+	FOR i IN 1..300 LOOP
+		EXECUTE 'SELECT ' || cond INTO done;
+		EXIT WHEN done;
+		PERFORM pg_sleep(0.1);
+	END LOOP;
+END
+$$ LANGUAGE plpgsql;
+-- scenario script
+DO $$
+BEGIN
+	EXECUTE format('COPY (SELECT %L) TO %L', 'set DELETE error',
+				   current_setting('data_directory') || '/pg_simula_scenario.txt');
+END
+$$;
+ALTER SYSTEM SET pg_simula.scenario_script = 'pg_simula_scenario.txt';
+SELECT pg_reload_conf();
+SELECT wait_for('EXISTS (SELECT FROM pg_simula_stats WHERE dbid = 0)');
+SELECT dbid, operation, action FROM pg_simula_stats WHERE dbid = 0;
+DELETE FROM s;
+-- simula_events takes precedence
+SELECT add_simula_event('DELETE', 'WAIT', 0);
+DELETE FROM s;
+SELECT clear_all_events();
+DELETE FROM s;
+ALTER SYSTEM RESET pg_simula.scenario_script;
+SELECT pg_reload_conf();
+SELECT wait_for('NOT EXISTS (SELECT FROM pg_simula_stats WHERE dbid = 0)');
+DELETE FROM s;
+-- scenario file
+DO $$
+BEGIN
+	EXECUTE format('COPY (SELECT %L) TO %L', '[{"operation": "TRUNCATE TABLE", "action": "error"}]',
+				   current_setting('data_directory') || '/pg_simula_scenario.json');
+END
+$$;
+ALTER SYSTEM SET pg_simula.scenario_file = 'pg_simula_scenario.json';
+SELECT pg_reload_conf();
+SELECT wait_for('EXISTS (SELECT FROM pg_simula_stats WHERE dbid = 0)');
+SELECT dbid, operation, action FROM pg_simula_stats WHERE dbid = 0;
+TRUNCATE s;
+ALTER SYSTEM RESET pg_simula.scenario_file;
+SELECT pg_reload_conf();
+SELECT wait_for('NOT EXISTS (SELECT FROM pg_simula_stats WHERE dbid = 0)');
+TRUNCATE s;
+DROP FUNCTION wait_for(text);
+DROP TABLE s;